@@ -0,0 +1,153 @@
+/*
+ * Tilemap Town client for 3DS
+ *
+ * Copyright (C) 2024 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "town.hpp"
+
+// Command line frontend for the headless build
+
+int network_init();
+void network_finish();
+void run_benchmarks();
+int replay_capture(const char *filename, bool realtime, bool fast_path);
+int check_capture_decoders(const char *filename);
+
+extern char login_username[256];
+extern char login_password[256];
+extern bool guest_login;
+
+static void usage() {
+	puts("Usage:\n"
+	     "  tilemaptown-cli connect [host] [path] [port] [options]\n"
+	     "      --seconds N       Stay connected for N seconds (default 10)\n"
+	     "      --capture FILE    Record everything the server sends\n"
+	     "      --plain           Websocket without TLS, for town-server\n"
+	     "      --user NAME --password PASSWORD\n"
+	     "  tilemaptown-cli replay FILE [--realtime] [--no-fast-path]\n"
+	     "  tilemaptown-cli check-decoders FILE\n"
+	     "  tilemaptown-cli bench");
+}
+
+static int command_connect(int argc, char *argv[]) {
+	const char *positional[3] = {"novasquirrel.com", "/townws/", "443"};
+	int positional_count = 0;
+	int seconds = 10;
+	const char *capture = NULL;
+	bool plain = false;
+
+	for(int i=0; i<argc; i++) {
+		if(!strcmp(argv[i], "--seconds") && i+1 < argc) {
+			seconds = strtol(argv[++i], NULL, 10);
+		} else if(!strcmp(argv[i], "--capture") && i+1 < argc) {
+			capture = argv[++i];
+		} else if(!strcmp(argv[i], "--plain")) {
+			plain = true;
+		} else if(!strcmp(argv[i], "--user") && i+1 < argc) {
+			snprintf(login_username, sizeof(login_username), "%s", argv[++i]);
+			guest_login = false;
+		} else if(!strcmp(argv[i], "--password") && i+1 < argc) {
+			snprintf(login_password, sizeof(login_password), "%s", argv[++i]);
+		} else if(argv[i][0] != '-' && positional_count < 3) {
+			positional[positional_count++] = argv[i];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+
+	if(!network_init()) {
+		puts("network_init call failed!");
+		return 1;
+	}
+
+	TilemapTownClient *client = new TilemapTownClient();
+	client->plain_websocket = plain;
+	printf("Connecting to %s:%s%s\n", positional[0], positional[2], positional[1]);
+	if(!client->network_connect(positional[0], positional[1], positional[2])) {
+		puts("Couldn't connect to the server");
+		delete client;
+		network_finish();
+		return 1;
+	}
+	if(capture)
+		client->start_capture(capture);
+
+	// Tick at the same rate the 3DS would
+	uint64_t end = get_time_us() + (uint64_t)seconds * 1000000;
+	while(client->connected && get_time_us() < end) {
+		client->network_update();
+		struct timespec delay = {0, 16666666};
+		nanosleep(&delay, NULL);
+	}
+
+	printf("Map %d: %dx%d, %s\n", client->town_map.id, client->town_map.width, client->town_map.height, client->map_received ? "received" : "not received");
+	printf("%zu entities, %zu tiles, %zu JSON tiles\n", client->entities.count, client->tileset.size(), client->json_tileset.size());
+	client->print_network_stats();
+
+	client->network_disconnect();
+	if(client->websocket) {
+		wslay_event_context_free(client->websocket);
+		client->websocket = nullptr;
+	}
+	delete client;
+	network_finish();
+	return 0;
+}
+
+static int command_replay(int argc, char *argv[]) {
+	const char *filename = NULL;
+	bool realtime = false;
+	bool fast_path = true;
+
+	for(int i=0; i<argc; i++) {
+		if(!strcmp(argv[i], "--realtime")) {
+			realtime = true;
+		} else if(!strcmp(argv[i], "--no-fast-path")) {
+			fast_path = false;
+		} else if(argv[i][0] != '-' && !filename) {
+			filename = argv[i];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if(!filename) {
+		usage();
+		return 1;
+	}
+	return replay_capture(filename, realtime, fast_path) ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+	if(argc < 2) {
+		usage();
+		return 1;
+	}
+
+	if(!strcmp(argv[1], "connect"))
+		return command_connect(argc-2, argv+2);
+	if(!strcmp(argv[1], "replay"))
+		return command_replay(argc-2, argv+2);
+	if(!strcmp(argv[1], "check-decoders") && argc == 3)
+		return check_capture_decoders(argv[2]) ? 0 : 1;
+	if(!strcmp(argv[1], "bench")) {
+		run_benchmarks();
+		return 0;
+	}
+	usage();
+	return 1;
+}
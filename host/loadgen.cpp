@@ -0,0 +1,457 @@
+/*
+ * Tilemap Town client for 3DS
+ *
+ * Copyright (C) 2024 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS // For the socket's fd, which mbedtls 3 hides
+#include "town.hpp"
+#include "cJSON.h"
+#include <algorithm>
+#include <random>
+#include <poll.h>
+#include <signal.h>
+
+// town-loadgen: lots of headless client sessions in one process, all run from a single poll()
+// loop. Each one is a full TilemapTownClient, so connecting, IDN, movement and chat go through
+// the same code the 3DS uses. The sessions walk and chat on timers, and the report at the end has
+// connect throughput, handshake and login times, and round trip percentiles for PIN and for MOV echoes.
+//
+// network_connect blocks for the whole handshake, so every other session stalls while one connects.
+// Round trips measured while sessions are still connecting are reported separately for that reason.
+
+int network_init();
+void network_finish();
+
+enum WalkPattern {
+	WALK_IDLE,    // Stand still
+	WALK_RANDOM,  // A new random direction every step
+	WALK_WANDER,  // Keep going in one direction for a while, then pick another
+	WALK_PACE,    // Back and forth along a line
+};
+
+static struct {
+	const char *host = "localhost";
+	const char *path = "/";
+	const char *port = "8080";
+	bool plain = false;
+	int clients = 100;
+	double ramp = 20;          // Connects per second, or 0 for each one as soon as the last finished
+	int seconds = 30;          // How long to run after the last session connects
+	enum WalkPattern walk = WALK_WANDER;
+	double walk_rate = 2;      // Steps per second per session
+	int pace_length = 8;
+	double chat_rate = 1;      // Messages per minute per session
+	int chat_length = 40;
+	double ping_interval = 2;  // Seconds between PINs per session, or 0 for none
+	int report = 5;            // Seconds between progress lines
+	unsigned int seed = 1;
+} options;
+
+struct Session {
+	TilemapTownClient *client;
+	int number;
+	bool active;
+	uint64_t connect_started_at;
+	uint64_t connected_at;      // Websocket is up
+	bool logged_in;             // Got the map and found ourselves in the WHO list
+	uint64_t next_step_at;
+	uint64_t next_chat_at;
+	uint64_t next_ping_at;
+	int direction;              // Walk state
+	int steps_left;
+	unsigned int steps, chats, pings;
+	size_t ramp_pin_samples;    // How many round trips had been measured when the last session connected
+	size_t ramp_mov_samples;
+};
+
+static struct {
+	unsigned int connect_attempts, connect_failures, disconnects;
+	std::vector<uint32_t> connect_us;  // network_connect call, including the TLS and websocket handshakes
+	uint64_t last_connected_at;
+	std::vector<uint32_t> login_us;    // From starting to connect until the map arrives
+	unsigned int steps, chats, pings;
+} totals;
+
+static std::mt19937 rng;
+static volatile bool want_to_exit = false;
+
+static void handle_signal(int signal) {
+	want_to_exit = true;
+}
+
+// Plus or minus half, so the sessions don't all act on the same tick
+static uint64_t jittered_interval_us(double per_second) {
+	double interval = 1000000.0 / per_second;
+	return (uint64_t)(interval * std::uniform_real_distribution<double>(0.5, 1.5)(rng));
+}
+
+// ----------------------------------------------
+// - Sessions
+// ----------------------------------------------
+
+static bool start_session(Session *session) {
+	TilemapTownClient *client = new TilemapTownClient();
+	client->plain_websocket = options.plain;
+	client->quiet_chat = true;
+	client->measure_round_trips = true;
+	session->client = client;
+
+	totals.connect_attempts++;
+	session->connect_started_at = get_time_us();
+	if(!client->network_connect(options.host, options.path, options.port)) {
+		totals.connect_failures++;
+		delete client;
+		session->client = nullptr;
+		return false;
+	}
+	session->connected_at = get_time_us();
+	totals.connect_us.push_back(session->connected_at - session->connect_started_at);
+	totals.last_connected_at = session->connected_at;
+	session->active = true;
+	return true;
+}
+
+static void end_session(Session *session) {
+	TilemapTownClient *client = session->client;
+	if(!client)
+		return;
+	totals.steps += session->steps;
+	totals.chats += session->chats;
+	totals.pings += session->pings;
+	client->network_disconnect();
+	if(client->websocket) {
+		wslay_event_context_free(client->websocket);
+		client->websocket = nullptr;
+	}
+	session->active = false;
+}
+
+static void take_step(Session *session) {
+	TilemapTownClient *client = session->client;
+	const int offsets[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+
+	switch(options.walk) {
+		case WALK_IDLE:
+			return;
+		case WALK_RANDOM:
+			session->direction = rng() % 4;
+			break;
+		case WALK_WANDER:
+			if(session->steps_left <= 0) {
+				session->direction = rng() % 4;
+				session->steps_left = 1 + rng() % 10;
+			}
+			session->steps_left--;
+			break;
+		case WALK_PACE:
+			if(session->steps_left <= 0) {
+				session->direction = (session->direction + 2) % 4;
+				session->steps_left = options.pace_length;
+			}
+			session->steps_left--;
+			break;
+	}
+	client->move_player(offsets[session->direction][0], offsets[session->direction][1]);
+	session->steps++;
+}
+
+static void send_chat(Session *session) {
+	char text[256];
+	int length = snprintf(text, sizeof(text), "Load test %d message %u", session->number, session->chats);
+	// Pad it out to the requested length
+	for(; length < options.chat_length && length < (int)sizeof(text)-1; length++)
+		text[length] = 'a' + (length % 26);
+	text[length] = 0;
+
+	cJSON *json = cJSON_CreateObject();
+	cJSON_AddStringToObject(json, "text", text);
+	session->client->websocket_write("MSG", json);
+	cJSON_Delete(json);
+	session->chats++;
+}
+
+// Returns true if the session did anything that needs a network tick
+static bool run_session_timers(Session *session, uint64_t now) {
+	TilemapTownClient *client = session->client;
+	bool acted = false;
+
+	if(!session->logged_in) {
+		if(!client->map_received || !client->your_entity())
+			return false;
+		session->logged_in = true;
+		totals.login_us.push_back(now - session->connect_started_at);
+		session->direction = rng() % 4;
+		session->next_step_at = now + jittered_interval_us(options.walk_rate);
+		session->next_chat_at = now + jittered_interval_us(options.chat_rate / 60);
+		session->next_ping_at = now + (uint64_t)(options.ping_interval * 1000000 * std::uniform_real_distribution<double>(0, 1)(rng));
+	}
+
+	if(options.walk != WALK_IDLE && options.walk_rate > 0 && now >= session->next_step_at) {
+		take_step(session);
+		session->next_step_at += jittered_interval_us(options.walk_rate);
+		if(session->next_step_at < now) // Fell behind, so don't try to catch up all at once
+			session->next_step_at = now;
+		acted = true;
+	}
+	if(options.chat_rate > 0 && now >= session->next_chat_at) {
+		send_chat(session);
+		session->next_chat_at = now + jittered_interval_us(options.chat_rate / 60);
+		acted = true;
+	}
+	if(options.ping_interval > 0 && now >= session->next_ping_at) {
+		if(!client->ping_sent_at) {
+			client->send_ping();
+			session->pings++;
+		}
+		session->next_ping_at = now + (uint64_t)(options.ping_interval * 1000000);
+		acted = true;
+	}
+	return acted;
+}
+
+static bool has_outbound(TilemapTownClient *client) {
+	if(client->pending_move.active || !client->pending_image_requests.empty())
+		return true;
+	for(int lane=0; lane<LANE_COUNT; lane++)
+		if(!client->outbound_lanes[lane].messages.empty())
+			return true;
+	return client->websocket && wslay_event_want_write(client->websocket);
+}
+
+// ----------------------------------------------
+// - Reporting
+// ----------------------------------------------
+
+static void print_percentiles(const char *name, std::vector<uint32_t> &samples) {
+	if(samples.empty()) {
+		printf("%-14s no samples\n", name);
+		return;
+	}
+	std::sort(samples.begin(), samples.end());
+	auto at = [&](double fraction) {
+		return samples[std::min(samples.size()-1, (size_t)(fraction * samples.size()))] / 1000.0;
+	};
+	printf("%-14s %7zu samples  p50 %7.2f  p90 %7.2f  p99 %7.2f  max %7.2f ms\n", name, samples.size(), at(0.5), at(0.9), at(0.99), samples.back() / 1000.0);
+}
+
+// Samples from before the ramp finished go into ramp, and the rest into steady
+static void split_samples(const std::vector<uint32_t> &samples, size_t ramp_count, std::vector<uint32_t> &ramp, std::vector<uint32_t> &steady) {
+	ramp_count = std::min(ramp_count, samples.size());
+	ramp.insert(ramp.end(), samples.begin(), samples.begin() + ramp_count);
+	steady.insert(steady.end(), samples.begin() + ramp_count, samples.end());
+}
+
+static void print_report(std::vector<Session> &sessions, uint64_t started_at) {
+	std::vector<uint32_t> mov, pin, ramp_mov, ramp_pin;
+	unsigned int confirmed = 0, corrected = 0;
+	for(Session &session : sessions) {
+		if(!session.client)
+			continue;
+		confirmed += session.client->prediction_stats.confirmed;
+		corrected += session.client->prediction_stats.corrected;
+		split_samples(session.client->mov_round_trips_us, session.ramp_mov_samples, ramp_mov, mov);
+		split_samples(session.client->pin_round_trips_us, session.ramp_pin_samples, ramp_pin, pin);
+	}
+	unsigned int connected = totals.connect_attempts - totals.connect_failures;
+
+	puts("");
+	printf("Connects: %u of %u succeeded, %u dropped later\n", connected, totals.connect_attempts, totals.disconnects);
+	if(connected) {
+		// From the first connect starting to the last one finishing
+		uint64_t connecting_us = std::max<uint64_t>(totals.last_connected_at - started_at, 1);
+		printf("Connect throughput: %.1f/s over %.1f s", connected * 1000000.0 / connecting_us, connecting_us / 1000000.0);
+		if(options.ramp > 0)
+			printf(", held to %.1f/s by --ramp", options.ramp);
+		puts("");
+	}
+	printf("Sent: %u steps, %u chat messages, %u PINs\n", totals.steps, totals.chats, totals.pings);
+	printf("Moves: %u confirmed by the server, %u corrected\n", confirmed, corrected);
+	print_percentiles("Handshake", totals.connect_us);
+	print_percentiles("Login", totals.login_us);
+	puts("While connecting, when other sessions' handshakes hold up the loop:");
+	print_percentiles("PIN RTT", ramp_pin);
+	print_percentiles("MOV echo RTT", ramp_mov);
+	puts("Once everyone's connected:");
+	print_percentiles("PIN RTT", pin);
+	print_percentiles("MOV echo RTT", mov);
+}
+
+// ----------------------------------------------
+
+static void usage() {
+	puts("Usage: town-loadgen [host] [path] [port] [options]\n"
+	     "  --plain              Websocket without TLS, for town-server\n"
+	     "  --clients N          Sessions to run (default 100)\n"
+	     "  --ramp R             Connects per second, or 0 to start each as soon as the last finishes (default 20)\n"
+	     "  --seconds S          How long to keep going once everyone's connected (default 30)\n"
+	     "  --walk PATTERN       idle, random, wander or pace (default wander)\n"
+	     "  --walk-rate R        Steps per second per session (default 2)\n"
+	     "  --pace-length N      Steps each way for pace (default 8)\n"
+	     "  --chat-rate R        Chat messages per minute per session (default 1)\n"
+	     "  --chat-length N      Characters per chat message (default 40)\n"
+	     "  --ping S             Seconds between PINs per session, 0 for none (default 2)\n"
+	     "  --report S           Seconds between progress lines (default 5)\n"
+	     "  --seed N             Random seed");
+}
+
+static bool parse_walk_pattern(const char *name) {
+	const char *names[] = {"idle", "random", "wander", "pace"};
+	for(int i=0; i<4; i++) {
+		if(!strcmp(name, names[i])) {
+			options.walk = (enum WalkPattern)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(int argc, char *argv[]) {
+	const char *positional[3] = {options.host, options.path, options.port};
+	int positional_count = 0;
+
+	for(int i=1; i<argc; i++) {
+		const char *value = (i+1 < argc) ? argv[i+1] : NULL;
+		if(!strcmp(argv[i], "--plain")) {
+			options.plain = true;
+			continue;
+		} else if(argv[i][0] != '-') {
+			if(positional_count >= 3) {
+				usage();
+				return 1;
+			}
+			positional[positional_count++] = argv[i];
+			continue;
+		}
+		if(!value) {
+			usage();
+			return 1;
+		}
+		i++;
+		if(!strcmp(argv[i-1], "--clients"))          options.clients = strtol(value, NULL, 10);
+		else if(!strcmp(argv[i-1], "--ramp"))        options.ramp = strtod(value, NULL);
+		else if(!strcmp(argv[i-1], "--seconds"))     options.seconds = strtol(value, NULL, 10);
+		else if(!strcmp(argv[i-1], "--walk-rate"))   options.walk_rate = strtod(value, NULL);
+		else if(!strcmp(argv[i-1], "--pace-length")) options.pace_length = strtol(value, NULL, 10);
+		else if(!strcmp(argv[i-1], "--chat-rate"))   options.chat_rate = strtod(value, NULL);
+		else if(!strcmp(argv[i-1], "--chat-length")) options.chat_length = strtol(value, NULL, 10);
+		else if(!strcmp(argv[i-1], "--ping"))        options.ping_interval = strtod(value, NULL);
+		else if(!strcmp(argv[i-1], "--report"))      options.report = strtol(value, NULL, 10);
+		else if(!strcmp(argv[i-1], "--seed"))        options.seed = strtoul(value, NULL, 10);
+		else if(!strcmp(argv[i-1], "--walk") && parse_walk_pattern(value)) {}
+		else {
+			usage();
+			return 1;
+		}
+	}
+	options.host = positional[0];
+	options.path = positional[1];
+	options.port = positional[2];
+	if(options.clients < 1 || options.ramp < 0) {
+		usage();
+		return 1;
+	}
+
+	if(network_init() == 0) {
+		puts("network_init call failed!");
+		return 1;
+	}
+	rng.seed(options.seed);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGINT, handle_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	std::vector<Session> sessions(options.clients);
+	std::vector<struct pollfd> fds;
+	std::vector<Session*> polled;
+	int next_to_connect = 0;
+	uint64_t started_at = get_time_us();
+	uint64_t ramp_done_at = 0;
+	uint64_t next_report_at = started_at + options.report * 1000000ULL;
+
+	if(options.ramp > 0)
+		printf("%d sessions to %s:%s%s, %.1f connects/s\n", options.clients, options.host, options.port, options.path, options.ramp);
+	else
+		printf("%d sessions to %s:%s%s, connecting as fast as possible\n", options.clients, options.host, options.port, options.path);
+	while(!want_to_exit) {
+		uint64_t now = get_time_us();
+
+		// Connect on schedule. network_connect blocks for the handshake, so only do one per pass
+		bool connecting = next_to_connect < options.clients;
+		if(connecting && (options.ramp == 0 || now >= started_at + (uint64_t)(next_to_connect * 1000000.0 / options.ramp))) {
+			Session *session = &sessions[next_to_connect];
+			session->number = next_to_connect;
+			start_session(session);
+			next_to_connect++;
+			if(next_to_connect == options.clients) {
+				ramp_done_at = get_time_us();
+				// Round trips from here on are the ones that weren't held up by handshakes
+				for(Session &other : sessions) {
+					if(!other.client)
+						continue;
+					other.ramp_pin_samples = other.client->pin_round_trips_us.size();
+					other.ramp_mov_samples = other.client->mov_round_trips_us.size();
+				}
+			}
+		}
+		if(ramp_done_at && now >= ramp_done_at + options.seconds * 1000000ULL)
+			break;
+
+		// Wait for any socket to have something, or for the next timer
+		fds.clear();
+		polled.clear();
+		for(Session &session : sessions) {
+			if(!session.active)
+				continue;
+			short events = POLLIN;
+			if(has_outbound(session.client))
+				events |= POLLOUT;
+			fds.push_back({session.client->server_fd.fd, events, 0});
+			polled.push_back(&session);
+		}
+		poll(fds.data(), fds.size(), (connecting && options.ramp == 0) ? 0 : 5);
+
+		now = get_time_us();
+		for(size_t i=0; i<polled.size(); i++) {
+			Session *session = polled[i];
+			bool acted = run_session_timers(session, now);
+			if(fds[i].revents || acted || has_outbound(session->client))
+				session->client->network_update();
+			if(!session->client->connected) {
+				totals.disconnects++;
+				end_session(session);
+			}
+		}
+
+		if(options.report && now >= next_report_at) {
+			int active = 0, logged_in = 0;
+			for(Session &session : sessions) {
+				active += session.active;
+				logged_in += session.active && session.logged_in;
+			}
+			printf("%5.1f s: %d connected, %d in the map, %u failed\n", (now - started_at) / 1000000.0, active, logged_in, totals.connect_failures);
+			next_report_at += options.report * 1000000ULL;
+		}
+	}
+
+	for(Session &session : sessions)
+		if(session.active)
+			end_session(&session);
+	print_report(sessions, started_at);
+	for(Session &session : sessions)
+		delete session.client;
+	network_finish();
+	return 0;
+}
@@ -0,0 +1,1097 @@
+/*
+ * Tilemap Town client for 3DS
+ *
+ * Copyright (C) 2024 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// town-server: a small stand-in for the Tilemap Town server, so the client can be benchmarked
+// without the real one. It speaks the part of the protocol the client implements (IDN, MAI,
+// MAP, BLK, WHO, MOV, RSC, IMG, PIN and MSG) over a plain or TLS websocket, generates a
+// synthetic map with synthetic entities walking around it, can produce BLK edit storms, and
+// serves the tile sheets over HTTP.
+
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS // For the sockets' fds, which mbedtls 3 hides
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <png.h>
+#include <wslay/wslay.h>
+
+#include "mbedtls/version.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/base64.h"
+
+#include "cJSON.h"
+
+#define protocol_command_as_int(a,b,c) ((a) | ((b)<<8) | ((c)<<16))
+
+#define TILE_SHEET_TILES 16   // Tile sheets are 16x16 tiles of 16x16 pixels
+#define MAP_CELLS_PER_MESSAGE 4096
+
+// ----------------------------------------------
+// - Settings
+// ----------------------------------------------
+
+struct ServerOptions {
+	int map_width = 64;
+	int map_height = 64;
+	int entities = 0;        // Synthetic entities walking around the map
+	double mov_rate = 1;     // Steps per second, for each synthetic entity
+	double blk_rate = 0;     // BLK messages per second
+	int blk_size = 16;       // Cells changed by each BLK
+	int tile_kinds = 32;     // Half of these are turfs, and half are objects
+	int sheets = 4;          // Sheet 0 is listed in RSC, the rest have to be requested with IMG
+	double obj_density = 0.1;
+	int keepalive = 30;      // Seconds between PINs
+	int stats = 5;           // Seconds between printing stats, or 0 for never
+	unsigned int seed = 1;
+	std::string host = "localhost";
+	std::string port = "8080";
+	std::string http_port = "8081";
+	std::string cert_file, key_file;
+} options;
+
+static bool set_option(const char *name, const char *value) {
+	if(!strcmp(name, "map")) {
+		if(sscanf(value, "%dx%d", &options.map_width, &options.map_height) != 2)
+			return false;
+	} else if(!strcmp(name, "entities"))    options.entities = strtol(value, NULL, 10);
+	else if(!strcmp(name, "mov-rate"))      options.mov_rate = strtod(value, NULL);
+	else if(!strcmp(name, "blk-rate"))      options.blk_rate = strtod(value, NULL);
+	else if(!strcmp(name, "blk-size"))      options.blk_size = strtol(value, NULL, 10);
+	else if(!strcmp(name, "tile-kinds"))    options.tile_kinds = strtol(value, NULL, 10);
+	else if(!strcmp(name, "sheets"))        options.sheets = strtol(value, NULL, 10);
+	else if(!strcmp(name, "obj-density"))   options.obj_density = strtod(value, NULL);
+	else if(!strcmp(name, "keepalive"))     options.keepalive = strtol(value, NULL, 10);
+	else if(!strcmp(name, "stats"))         options.stats = strtol(value, NULL, 10);
+	else if(!strcmp(name, "seed"))          options.seed = strtoul(value, NULL, 10);
+	else if(!strcmp(name, "host"))          options.host = value;
+	else if(!strcmp(name, "port"))          options.port = value;
+	else if(!strcmp(name, "http-port"))     options.http_port = value;
+	else if(!strcmp(name, "cert"))          options.cert_file = value;
+	else if(!strcmp(name, "key"))           options.key_file = value;
+	else
+		return false;
+	return true;
+}
+
+// Script lines look like "10 entities 500": at 10 seconds in, set entities to 500
+struct ScriptStep {
+	double time;
+	std::string name;
+	std::string value;
+};
+static std::vector<ScriptStep> script;
+static size_t script_position;
+
+static bool load_script(const char *filename) {
+	FILE *file = fopen(filename, "rb");
+	if(!file) {
+		printf("Couldn't open script %s\n", filename);
+		return false;
+	}
+	char line[256], name[64], value[128];
+	double time;
+	while(fgets(line, sizeof(line), file)) {
+		if(*line == '#' || *line == ';')
+			continue;
+		if(sscanf(line, "%lf %63s %127s", &time, name, value) == 3)
+			script.push_back({time, name, value});
+	}
+	fclose(file);
+	return true;
+}
+
+static uint64_t now_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// ----------------------------------------------
+// - World
+// ----------------------------------------------
+
+struct ServerEntity {
+	int id;
+	std::string name;
+	int x, y, dir;
+	bool synthetic;
+};
+
+struct ServerMap {
+	int width, height;
+	std::vector<int> turf;               // Tile kind for each cell
+	std::vector<std::vector<int>> objs;  // Object tile kinds for each cell
+};
+
+static ServerMap town_map;
+static std::map<int, ServerEntity> entities;
+static std::vector<int> synthetic_ids;
+static int next_entity_id = 1;
+static std::mt19937 rng;
+
+static std::string tile_key(int kind) {
+	return "t" + std::to_string(kind);
+}
+
+static int random_int(int limit) {
+	return std::uniform_int_distribution<int>(0, limit-1)(rng);
+}
+
+static int turf_kinds() {
+	return std::max(1, options.tile_kinds / 2);
+}
+
+static int obj_kinds() {
+	return std::max(1, options.tile_kinds - turf_kinds());
+}
+
+static void generate_map() {
+	int cells = options.map_width * options.map_height;
+	town_map.width = options.map_width;
+	town_map.height = options.map_height;
+	town_map.turf.assign(cells, 0);
+	town_map.objs.assign(cells, std::vector<int>());
+
+	std::uniform_real_distribution<double> chance(0.0, 1.0);
+	for(int i=0; i<cells; i++) {
+		if(chance(rng) < 0.3)
+			town_map.turf[i] = random_int(turf_kinds());
+		if(chance(rng) < options.obj_density) {
+			town_map.objs[i].push_back(turf_kinds() + random_int(obj_kinds()));
+			if(chance(rng) < 0.25)
+				town_map.objs[i].push_back(turf_kinds() + random_int(obj_kinds()));
+		}
+	}
+}
+
+static cJSON *entity_json(ServerEntity *entity) {
+	cJSON *json = cJSON_CreateObject();
+	int pic[3] = {0, entity->id % TILE_SHEET_TILES, TILE_SHEET_TILES-1};
+	cJSON_AddNumberToObject(json, "id", entity->id);
+	cJSON_AddStringToObject(json, "name", entity->name.c_str());
+	cJSON_AddItemToObject(json, "pic", cJSON_CreateIntArray(pic, 3));
+	cJSON_AddNumberToObject(json, "x", entity->x);
+	cJSON_AddNumberToObject(json, "y", entity->y);
+	cJSON_AddNumberToObject(json, "dir", entity->dir);
+	cJSON_AddBoolToObject(json, "in_user_list", !entity->synthetic);
+	return json;
+}
+
+// ----------------------------------------------
+// - Tile sheets
+// ----------------------------------------------
+
+static std::unordered_map<int, std::string> sheet_png;
+
+static void png_write_to_string(png_structp png, png_bytep data, png_size_t length) {
+	std::string *out = (std::string*)png_get_io_ptr(png);
+	out->append((const char*)data, length);
+}
+
+static void png_flush_nothing(png_structp png) {
+}
+
+// Each tile gets its own color with a darker border, so it's easy to tell if the wrong one is drawn
+static std::string *get_sheet_png(int sheet) {
+	auto it = sheet_png.find(sheet);
+	if(it != sheet_png.end())
+		return &(*it).second;
+
+	const int size = TILE_SHEET_TILES * 16;
+	std::vector<uint8_t> pixels(size * size * 4);
+	for(int y=0; y<size; y++) {
+		for(int x=0; x<size; x++) {
+			uint32_t hash = (sheet * 2654435761u) ^ ((y/16 * TILE_SHEET_TILES + x/16) * 40503u);
+			hash ^= hash >> 13;
+			hash *= 0x5bd1e995;
+			bool border = (x % 16 == 0) || (y % 16 == 0) || (x % 16 == 15) || (y % 16 == 15);
+			uint8_t *pixel = &pixels[(y * size + x) * 4];
+			pixel[0] = (hash & 255)         >> (border ? 1 : 0);
+			pixel[1] = ((hash >> 8) & 255)  >> (border ? 1 : 0);
+			pixel[2] = ((hash >> 16) & 255) >> (border ? 1 : 0);
+			pixel[3] = 255;
+		}
+	}
+
+	std::string out;
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png_create_info_struct(png);
+	if(setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		return nullptr;
+	}
+	png_set_write_fn(png, &out, png_write_to_string, png_flush_nothing);
+	png_set_IHDR(png, info, size, size, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+	for(int y=0; y<size; y++)
+		png_write_row(png, &pixels[y * size * 4]);
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+
+	sheet_png[sheet] = out;
+	return &sheet_png[sheet];
+}
+
+static std::string sheet_url(int sheet) {
+	return "http://" + options.host + ":" + options.http_port + "/sheet/" + std::to_string(sheet) + ".png";
+}
+
+// ----------------------------------------------
+// - Connections
+// ----------------------------------------------
+
+struct Connection {
+	mbedtls_net_context net;
+	mbedtls_ssl_context ssl;
+	bool tls;
+	bool tls_ready;          // TLS handshake finished
+	bool websocket_port;     // Otherwise it's on the HTTP port
+	bool closed;
+
+	// Before the upgrade, and for plain HTTP
+	std::string request;
+	std::string output;
+	size_t output_sent;
+	bool close_when_sent;
+
+	// After the upgrade
+	wslay_event_context_ptr websocket;
+	std::string leftover;    // Bytes read along with the HTTP request
+	int entity_id;           // 0 until IDN
+	bool batch;
+	bool awaiting_ping;
+	uint64_t last_ping;
+};
+
+static std::vector<Connection*> connections;
+static mbedtls_ssl_config tls_config;
+static mbedtls_x509_crt tls_cert;
+static mbedtls_pk_context tls_key;
+static mbedtls_entropy_context entropy;
+static mbedtls_ctr_drbg_context ctr_drbg;
+static bool use_tls;
+
+struct ServerStats {
+	unsigned int messages_in, messages_out, connects;
+	size_t bytes_out;
+} stats;
+
+static int connection_read(Connection *connection, unsigned char *buf, size_t len) {
+	if(connection->tls)
+		return mbedtls_ssl_read(&connection->ssl, buf, len);
+	return mbedtls_net_recv(&connection->net, buf, len);
+}
+
+static int connection_write(Connection *connection, const unsigned char *buf, size_t len) {
+	if(connection->tls)
+		return mbedtls_ssl_write(&connection->ssl, buf, len);
+	return mbedtls_net_send(&connection->net, buf, len);
+}
+
+static void send_text(Connection *connection, const std::string &text) {
+	if(!connection->websocket || connection->closed)
+		return;
+	struct wslay_event_msg message = {WSLAY_TEXT_FRAME, (const uint8_t*)text.c_str(), text.size()};
+	wslay_event_queue_msg(connection->websocket, &message);
+	stats.messages_out++;
+	stats.bytes_out += text.size();
+}
+
+static void send_json(Connection *connection, const char *command, cJSON *json) {
+	char *as_string = cJSON_PrintUnformatted(json);
+	send_text(connection, std::string(command) + " " + as_string);
+	free(as_string);
+}
+
+// Send to everyone who's finished IDN, optionally skipping one of them
+static void broadcast(const std::string &text, Connection *except = nullptr) {
+	for(Connection *connection : connections) {
+		if(connection->entity_id && connection != except)
+			send_text(connection, text);
+	}
+}
+
+static void broadcast_json(const char *command, cJSON *json, Connection *except = nullptr) {
+	char *as_string = cJSON_PrintUnformatted(json);
+	broadcast(std::string(command) + " " + as_string, except);
+	free(as_string);
+}
+
+// ----------------------------------------------
+// - Synthetic activity
+// ----------------------------------------------
+
+static void add_synthetic_entity() {
+	ServerEntity entity;
+	entity.id = next_entity_id++;
+	entity.name = "Bot " + std::to_string(entity.id);
+	entity.x = random_int(town_map.width);
+	entity.y = random_int(town_map.height);
+	entity.dir = 2;
+	entity.synthetic = true;
+	entities[entity.id] = entity;
+	synthetic_ids.push_back(entity.id);
+
+	cJSON *json = cJSON_CreateObject();
+	cJSON_AddItemToObject(json, "add", entity_json(&entities[entity.id]));
+	broadcast_json("WHO", json);
+	cJSON_Delete(json);
+}
+
+static void remove_entity(int id) {
+	entities.erase(id);
+	broadcast("WHO {\"remove\": " + std::to_string(id) + "}");
+}
+
+static void update_synthetic_entity_count() {
+	while((int)synthetic_ids.size() < options.entities)
+		add_synthetic_entity();
+	while((int)synthetic_ids.size() > options.entities) {
+		remove_entity(synthetic_ids.back());
+		synthetic_ids.pop_back();
+	}
+}
+
+static void step_synthetic_entity() {
+	if(synthetic_ids.empty())
+		return;
+	ServerEntity *entity = &entities[synthetic_ids[random_int(synthetic_ids.size())]];
+	static const int offsets[8][2] = {{1,0}, {1,1}, {0,1}, {-1,1}, {-1,0}, {-1,-1}, {0,-1}, {1,-1}};
+	int dir = random_int(4) * 2;
+	int from_x = entity->x, from_y = entity->y;
+	entity->x = std::min(std::max(entity->x + offsets[dir][0], 0), town_map.width-1);
+	entity->y = std::min(std::max(entity->y + offsets[dir][1], 0), town_map.height-1);
+	entity->dir = dir;
+
+	char buffer[128];
+	snprintf(buffer, sizeof(buffer), "MOV {\"id\": %d, \"from\": [%d, %d], \"to\": [%d, %d], \"dir\": %d}", entity->id, from_x, from_y, entity->x, entity->y, dir);
+	broadcast(buffer);
+}
+
+static void send_blk_storm() {
+	std::string turf, obj;
+	for(int i=0; i<options.blk_size; i++) {
+		int x = random_int(town_map.width);
+		int y = random_int(town_map.height);
+		int index = y * town_map.width + x;
+		if(i & 1) {
+			int kind = turf_kinds() + random_int(obj_kinds());
+			town_map.objs[index] = {kind};
+			obj += (obj.empty() ? "" : ", ") + std::string("[") + std::to_string(x) + ", " + std::to_string(y) + ", [\"" + tile_key(kind) + "\"]]";
+		} else {
+			int kind = random_int(turf_kinds());
+			town_map.turf[index] = kind;
+			turf += (turf.empty() ? "" : ", ") + std::string("[") + std::to_string(x) + ", " + std::to_string(y) + ", \"" + tile_key(kind) + "\"]";
+		}
+	}
+	broadcast("BLK {\"turf\": [" + turf + "], \"obj\": [" + obj + "]}");
+}
+
+// ----------------------------------------------
+// - Protocol
+// ----------------------------------------------
+
+static void send_resources(Connection *connection) {
+	cJSON *json = cJSON_CreateObject();
+	cJSON *images = cJSON_AddObjectToObject(json, "images");
+	cJSON_AddStringToObject(images, "0", sheet_url(0).c_str());
+
+	cJSON *tilesets = cJSON_AddObjectToObject(json, "tilesets");
+	cJSON *tileset = cJSON_AddObjectToObject(tilesets, "");
+	int sheets = std::max(1, options.sheets);
+	for(int kind=0; kind<turf_kinds() + obj_kinds(); kind++) {
+		int slot = kind / sheets;
+		int pic[3] = {kind % sheets, slot % TILE_SHEET_TILES, (slot / TILE_SHEET_TILES) % (TILE_SHEET_TILES-1)};
+		cJSON *tile = cJSON_AddObjectToObject(tileset, tile_key(kind).c_str());
+		cJSON_AddStringToObject(tile, "name", ("Tile " + std::to_string(kind)).c_str());
+		cJSON_AddItemToObject(tile, "pic", cJSON_CreateIntArray(pic, 3));
+		if(kind >= turf_kinds())
+			cJSON_AddTrueToObject(tile, "obj");
+		if(kind % 5 == 4)
+			cJSON_AddTrueToObject(tile, "density");
+	}
+	send_json(connection, "RSC", json);
+	cJSON_Delete(json);
+}
+
+static void send_map(Connection *connection) {
+	cJSON *json = cJSON_CreateObject();
+	int size[2] = {town_map.width, town_map.height};
+	cJSON_AddStringToObject(json, "name", "Synthetic map");
+	cJSON_AddNumberToObject(json, "id", 1);
+	cJSON_AddItemToObject(json, "size", cJSON_CreateIntArray(size, 2));
+	cJSON_AddStringToObject(json, "default", tile_key(0).c_str());
+	send_json(connection, "MAI", json);
+	cJSON_Delete(json);
+
+	// Split it into bands of rows, like the real server does for big maps
+	int rows = std::max(1, MAP_CELLS_PER_MESSAGE / town_map.width);
+	for(int y1=0; y1<town_map.height; y1 += rows) {
+		int y2 = std::min(y1 + rows, town_map.height) - 1;
+		std::string turf, obj;
+		for(int y=y1; y<=y2; y++) {
+			for(int x=0; x<town_map.width; x++) {
+				int index = y * town_map.width + x;
+				std::string xy = std::to_string(x) + ", " + std::to_string(y);
+				if(town_map.turf[index])
+					turf += (turf.empty() ? "[" : ", [") + xy + ", \"" + tile_key(town_map.turf[index]) + "\"]";
+				if(!town_map.objs[index].empty()) {
+					obj += (obj.empty() ? "[" : ", [") + xy + ", [";
+					for(size_t i=0; i<town_map.objs[index].size(); i++)
+						obj += (i ? ", \"" : "\"") + tile_key(town_map.objs[index][i]) + "\"";
+					obj += "]]";
+				}
+			}
+		}
+		send_text(connection, "MAP {\"pos\": [0, " + std::to_string(y1) + ", " + std::to_string(town_map.width-1) + ", " + std::to_string(y2) +
+			"], \"default\": \"" + tile_key(0) + "\", \"turf\": [" + turf + "], \"obj\": [" + obj + "]}");
+	}
+}
+
+static void handle_idn(Connection *connection, cJSON *json) {
+	if(connection->entity_id)
+		return;
+	cJSON *features = cJSON_GetObjectItemCaseSensitive(json, "features");
+	connection->batch = cJSON_IsObject(cJSON_GetObjectItemCaseSensitive(features, "batch"));
+	if(connection->batch)
+		send_text(connection, "IDN {\"features\": {\"batch\": {\"version\": \"0.0.1\"}}}");
+	else
+		send_text(connection, "IDN");
+
+	ServerEntity entity;
+	entity.id = next_entity_id++;
+	const char *username = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(json, "username"));
+	entity.name = username ? username : ("Guest " + std::to_string(entity.id));
+	entity.x = town_map.width / 2;
+	entity.y = town_map.height / 2;
+	entity.dir = 2;
+	entity.synthetic = false;
+	entities[entity.id] = entity;
+
+	send_text(connection, "MSG {\"text\": \"Welcome to the stand-in server\"}");
+	send_resources(connection);
+	send_map(connection);
+
+	cJSON *who = cJSON_CreateObject();
+	cJSON *list = cJSON_AddObjectToObject(who, "list");
+	for(auto & [id, other] : entities)
+		cJSON_AddItemToObject(list, std::to_string(id).c_str(), entity_json(&other));
+	cJSON_AddNumberToObject(who, "you", entity.id);
+	send_json(connection, "WHO", who);
+	cJSON_Delete(who);
+
+	// Only now does this connection start getting broadcasts
+	cJSON *add = cJSON_CreateObject();
+	cJSON_AddItemToObject(add, "add", entity_json(&entities[entity.id]));
+	broadcast_json("WHO", add, connection);
+	cJSON_Delete(add);
+	connection->entity_id = entity.id;
+}
+
+static void handle_mov(Connection *connection, cJSON *json) {
+	auto it = entities.find(connection->entity_id);
+	if(it == entities.end())
+		return;
+	ServerEntity *entity = &(*it).second;
+	cJSON *to   = cJSON_GetObjectItemCaseSensitive(json, "to");
+	cJSON *dir  = cJSON_GetObjectItemCaseSensitive(json, "dir");
+	int from_x = entity->x, from_y = entity->y;
+
+	// Bumps don't move anybody, and aren't shown to anyone
+	if(cJSON_GetObjectItemCaseSensitive(json, "bump"))
+		return;
+	if(cJSON_GetArraySize(to) == 2) {
+		entity->x = std::min(std::max(cJSON_GetArrayItem(to, 0)->valueint, 0), town_map.width-1);
+		entity->y = std::min(std::max(cJSON_GetArrayItem(to, 1)->valueint, 0), town_map.height-1);
+	}
+	if(cJSON_IsNumber(dir))
+		entity->dir = dir->valueint;
+
+	// This goes to everyone, including whoever moved, like the real server
+	char buffer[128];
+	snprintf(buffer, sizeof(buffer), "MOV {\"id\": %d, \"from\": [%d, %d], \"to\": [%d, %d], \"dir\": %d}", entity->id, from_x, from_y, entity->x, entity->y, entity->dir);
+	broadcast(buffer);
+}
+
+// Finds the map index for a BLK entry, or -1 if it's not on the map
+static int blk_index(cJSON *item) {
+	cJSON *x = cJSON_GetArrayItem(item, 0), *y = cJSON_GetArrayItem(item, 1);
+	if(!cJSON_IsNumber(x) || !cJSON_IsNumber(y) || x->valueint < 0 || y->valueint < 0 || x->valueint >= town_map.width || y->valueint >= town_map.height)
+		return -1;
+	return y->valueint * town_map.width + x->valueint;
+}
+
+// Only tiles from this server's own tileset can be stored; anything else becomes tile 0
+static int blk_tile_kind(cJSON *json) {
+	const char *key = cJSON_GetStringValue(json);
+	if(!key || key[0] != 't')
+		return 0;
+	return strtol(key+1, NULL, 10);
+}
+
+static void handle_blk(Connection *connection, const char *text, size_t length, cJSON *json) {
+	cJSON *item, *obj;
+	cJSON_ArrayForEach(item, cJSON_GetObjectItemCaseSensitive(json, "turf")) {
+		int index = blk_index(item);
+		if(index >= 0)
+			town_map.turf[index] = blk_tile_kind(cJSON_GetArrayItem(item, 2));
+	}
+	cJSON_ArrayForEach(item, cJSON_GetObjectItemCaseSensitive(json, "obj")) {
+		int index = blk_index(item);
+		if(index < 0)
+			continue;
+		town_map.objs[index].clear();
+		cJSON_ArrayForEach(obj, cJSON_GetArrayItem(item, 2)) {
+			town_map.objs[index].push_back(blk_tile_kind(obj));
+		}
+	}
+	// Edits get sent back out as-is
+	broadcast(std::string(text, length));
+}
+
+static void handle_message(Connection *connection, const char *text, size_t length) {
+	stats.messages_in++;
+	if(length < 3)
+		return;
+	cJSON *json = (length > 4) ? cJSON_ParseWithLength(text+4, length-4) : NULL;
+	int command = protocol_command_as_int(text[0], text[1], text[2]);
+
+	// Nothing but IDN until the client has identified
+	if(!connection->entity_id && command != protocol_command_as_int('I', 'D', 'N') && command != protocol_command_as_int('P', 'I', 'N')) {
+		cJSON_Delete(json);
+		return;
+	}
+
+	switch(command) {
+		case protocol_command_as_int('I', 'D', 'N'):
+			handle_idn(connection, json);
+			break;
+
+		case protocol_command_as_int('P', 'I', 'N'):
+			// Either the answer to a keepalive, or the client measuring round trip time
+			if(connection->awaiting_ping)
+				connection->awaiting_ping = false;
+			else
+				send_text(connection, "PIN");
+			break;
+
+		case protocol_command_as_int('M', 'O', 'V'):
+			handle_mov(connection, json);
+			break;
+
+		case protocol_command_as_int('B', 'L', 'K'):
+			handle_blk(connection, text, length, json);
+			break;
+
+		case protocol_command_as_int('I', 'M', 'G'):
+		{
+			cJSON *id = cJSON_GetObjectItemCaseSensitive(json, "id");
+			int sheet = cJSON_IsString(id) ? strtol(id->valuestring, NULL, 10) : (cJSON_IsNumber(id) ? id->valueint : -1);
+			if(sheet < 0 || sheet >= options.sheets)
+				break;
+			cJSON *reply = cJSON_CreateObject();
+			cJSON_AddItemReferenceToObject(reply, "id", id);
+			cJSON_AddStringToObject(reply, "url", sheet_url(sheet).c_str());
+			send_json(connection, "IMG", reply);
+			cJSON_Delete(reply);
+			break;
+		}
+
+		case protocol_command_as_int('M', 'S', 'G'):
+		{
+			const char *message_text = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(json, "text"));
+			if(!message_text)
+				break;
+			cJSON *reply = cJSON_CreateObject();
+			cJSON_AddStringToObject(reply, "text", message_text);
+			cJSON_AddStringToObject(reply, "name", entities[connection->entity_id].name.c_str());
+			cJSON_AddNumberToObject(reply, "id", connection->entity_id);
+			broadcast_json("MSG", reply);
+			cJSON_Delete(reply);
+			break;
+		}
+
+		case protocol_command_as_int('C', 'M', 'D'):
+			send_text(connection, "ERR {\"text\": \"Commands aren't supported by the stand-in server\"}");
+			break;
+	}
+	cJSON_Delete(json);
+}
+
+// ----------------------------------------------
+// - Websockets
+// ----------------------------------------------
+
+static ssize_t websocket_recv(wslay_event_context_ptr ctx, uint8_t *data, size_t len, int flags, void *user_data) {
+	Connection *connection = (Connection*)user_data;
+	if(!connection->leftover.empty()) {
+		size_t amount = std::min(len, connection->leftover.size());
+		memcpy(data, connection->leftover.data(), amount);
+		connection->leftover.erase(0, amount);
+		return amount;
+	}
+	int ret = connection_read(connection, data, len);
+	if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+		wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
+		return -1;
+	}
+	if(ret <= 0) {
+		wslay_event_set_error(ctx, WSLAY_ERR_CALLBACK_FAILURE);
+		return -1;
+	}
+	return ret;
+}
+
+static ssize_t websocket_send(wslay_event_context_ptr ctx, const uint8_t *data, size_t len, int flags, void *user_data) {
+	Connection *connection = (Connection*)user_data;
+	int ret = connection_write(connection, data, len);
+	if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+		wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
+		return -1;
+	}
+	if(ret < 0) {
+		wslay_event_set_error(ctx, WSLAY_ERR_CALLBACK_FAILURE);
+		return -1;
+	}
+	return ret;
+}
+
+static void websocket_message(wslay_event_context_ptr ctx, const struct wslay_event_on_msg_recv_arg *arg, void *user_data) {
+	Connection *connection = (Connection*)user_data;
+	if(arg->opcode == WSLAY_TEXT_FRAME)
+		handle_message(connection, (const char*)arg->msg, arg->msg_length);
+}
+
+static struct wslay_event_callbacks websocket_callbacks = {
+	websocket_recv,
+	websocket_send,
+	NULL, // Servers don't mask
+	NULL,
+	NULL,
+	NULL,
+	websocket_message,
+};
+
+// ----------------------------------------------
+// - HTTP
+// ----------------------------------------------
+
+static void http_respond(Connection *connection, const char *status, const char *type, const std::string &body) {
+	connection->output = std::string("HTTP/1.1 ") + status + "\r\n"
+		"Content-Type: " + type + "\r\n"
+		"Content-Length: " + std::to_string(body.size()) + "\r\n"
+		"Connection: close\r\n\r\n" + body;
+	connection->close_when_sent = true;
+}
+
+static std::string header_value(const std::string &request, const char *name) {
+	size_t name_length = strlen(name);
+	size_t line = request.find("\r\n");
+	while(line != std::string::npos && line + 2 < request.size()) {
+		size_t start = line + 2;
+		size_t end = request.find("\r\n", start);
+		if(end == std::string::npos)
+			break;
+		if(end - start > name_length && !strncasecmp(request.c_str() + start, name, name_length) && request[start + name_length] == ':') {
+			size_t value = start + name_length + 1;
+			while(value < end && request[value] == ' ')
+				value++;
+			return request.substr(value, end - value);
+		}
+		line = end;
+	}
+	return "";
+}
+
+static void handle_http_request(Connection *connection, size_t header_length) {
+	std::string request = connection->request.substr(0, header_length);
+	connection->leftover = connection->request.substr(header_length);
+	connection->request.clear();
+
+	char method[16], path[256];
+	if(sscanf(request.c_str(), "%15s %255s", method, path) != 2 || strcmp(method, "GET")) {
+		http_respond(connection, "400 Bad Request", "text/plain", "Bad request\n");
+		return;
+	}
+
+	// Tile sheets
+	int sheet;
+	if(sscanf(path, "/sheet/%d.png", &sheet) == 1 && sheet >= 0 && sheet < options.sheets) {
+		std::string *png = get_sheet_png(sheet);
+		if(png) {
+			http_respond(connection, "200 OK", "image/png", *png);
+			return;
+		}
+	}
+
+	// Websocket upgrade
+	std::string key = header_value(request, "Sec-WebSocket-Key");
+	if(connection->websocket_port && !key.empty()) {
+		std::string accept_input = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+		unsigned char sha1[20];
+		unsigned char accept[32];
+		size_t accept_length;
+		#if MBEDTLS_VERSION_MAJOR >= 3
+		mbedtls_sha1((const unsigned char*)accept_input.c_str(), accept_input.size(), sha1);
+		#else
+		mbedtls_sha1_ret((const unsigned char*)accept_input.c_str(), accept_input.size(), sha1);
+		#endif
+		mbedtls_base64_encode(accept, sizeof(accept), &accept_length, sha1, sizeof(sha1));
+
+		connection->output = "HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: " + std::string((const char*)accept, accept_length) + "\r\n\r\n";
+		wslay_event_context_server_init(&connection->websocket, &websocket_callbacks, connection);
+		wslay_event_config_set_max_recv_msg_length(connection->websocket, 0x100000);
+		connection->last_ping = now_us();
+		stats.connects++;
+		return;
+	}
+
+	http_respond(connection, "404 Not Found", "text/plain", "Not found\n");
+}
+
+// ----------------------------------------------
+// - Event loop
+// ----------------------------------------------
+
+static void accept_connections(mbedtls_net_context *listener, bool websocket_port) {
+	while(1) {
+		Connection *connection = new Connection();
+		mbedtls_net_init(&connection->net);
+		if(mbedtls_net_accept(listener, &connection->net, NULL, 0, NULL) != 0) {
+			delete connection;
+			return;
+		}
+		mbedtls_net_set_nonblock(&connection->net);
+		connection->websocket_port = websocket_port;
+		if(websocket_port && use_tls) {
+			connection->tls = true;
+			mbedtls_ssl_init(&connection->ssl);
+			mbedtls_ssl_setup(&connection->ssl, &tls_config);
+			mbedtls_ssl_set_bio(&connection->ssl, &connection->net, mbedtls_net_send, mbedtls_net_recv, NULL);
+		}
+		connections.push_back(connection);
+	}
+}
+
+static void close_connection(Connection *connection) {
+	if(connection->closed)
+		return;
+	connection->closed = true;
+	int id = connection->entity_id;
+	connection->entity_id = 0;
+	if(id)
+		remove_entity(id);
+}
+
+static void free_connection(Connection *connection) {
+	if(connection->websocket)
+		wslay_event_context_free(connection->websocket);
+	if(connection->tls) {
+		mbedtls_ssl_close_notify(&connection->ssl);
+		mbedtls_ssl_free(&connection->ssl);
+	}
+	mbedtls_net_free(&connection->net);
+	delete connection;
+}
+
+// Reads, writes, and handshakes for one connection that poll() says is ready
+static void service_connection(Connection *connection, short revents) {
+	if(revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		close_connection(connection);
+		return;
+	}
+
+	if(connection->tls && !connection->tls_ready) {
+		int ret = mbedtls_ssl_handshake(&connection->ssl);
+		if(ret != 0) {
+			if(ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+				close_connection(connection);
+			return;
+		}
+		connection->tls_ready = true;
+	}
+
+	// Plain output first: HTTP responses and the 101 upgrade
+	while(connection->output_sent < connection->output.size()) {
+		int ret = connection_write(connection, (const unsigned char*)connection->output.data() + connection->output_sent, connection->output.size() - connection->output_sent);
+		if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+			return;
+		if(ret <= 0) {
+			close_connection(connection);
+			return;
+		}
+		connection->output_sent += ret;
+	}
+	if(!connection->output.empty()) {
+		connection->output.clear();
+		connection->output_sent = 0;
+		if(connection->close_when_sent) {
+			close_connection(connection);
+			return;
+		}
+	}
+
+	if(connection->websocket) {
+		if(wslay_event_recv(connection->websocket) || wslay_event_send(connection->websocket)) {
+			close_connection(connection);
+			return;
+		}
+		if(!wslay_event_want_read(connection->websocket) && !wslay_event_want_write(connection->websocket))
+			close_connection(connection);
+		return;
+	}
+
+	// Still reading the HTTP request
+	if(!connection->output.empty())
+		return;
+	while(1) {
+		unsigned char buffer[2048];
+		int ret = connection_read(connection, buffer, sizeof(buffer));
+		if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+			return;
+		if(ret <= 0) {
+			close_connection(connection);
+			return;
+		}
+		connection->request.append((const char*)buffer, ret);
+		size_t end = connection->request.find("\r\n\r\n");
+		if(end != std::string::npos) {
+			handle_http_request(connection, end + 4);
+			return;
+		}
+		if(connection->request.size() > 16384) {
+			close_connection(connection);
+			return;
+		}
+	}
+}
+
+static volatile sig_atomic_t want_to_exit = 0;
+
+static void handle_signal(int signal) {
+	want_to_exit = 1;
+}
+
+static bool setup_tls() {
+	const char *personal = "town-server";
+	mbedtls_ssl_config_init(&tls_config);
+	mbedtls_x509_crt_init(&tls_cert);
+	mbedtls_pk_init(&tls_key);
+	mbedtls_entropy_init(&entropy);
+	mbedtls_ctr_drbg_init(&ctr_drbg);
+	if(mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char *)personal, strlen(personal)) != 0) {
+		puts("mbedtls_ctr_drbg_seed failed");
+		return false;
+	}
+	if(mbedtls_x509_crt_parse_file(&tls_cert, options.cert_file.c_str()) != 0) {
+		printf("Couldn't load certificate %s\n", options.cert_file.c_str());
+		return false;
+	}
+	#if MBEDTLS_VERSION_MAJOR >= 3
+	int ret = mbedtls_pk_parse_keyfile(&tls_key, options.key_file.c_str(), NULL, mbedtls_ctr_drbg_random, &ctr_drbg);
+	#else
+	int ret = mbedtls_pk_parse_keyfile(&tls_key, options.key_file.c_str(), NULL);
+	#endif
+	if(ret != 0) {
+		printf("Couldn't load key %s\n", options.key_file.c_str());
+		return false;
+	}
+	if(mbedtls_ssl_config_defaults(&tls_config, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+		puts("mbedtls_ssl_config_defaults failed");
+		return false;
+	}
+	mbedtls_ssl_conf_rng(&tls_config, mbedtls_ctr_drbg_random, &ctr_drbg);
+	if(mbedtls_ssl_conf_own_cert(&tls_config, &tls_cert, &tls_key) != 0) {
+		puts("mbedtls_ssl_conf_own_cert failed");
+		return false;
+	}
+	return true;
+}
+
+static void usage() {
+	puts("Usage: town-server [options]\n"
+	     "  --map WxH            Map size (default 64x64)\n"
+	     "  --entities N         Synthetic entities walking around (default 0)\n"
+	     "  --mov-rate R         Steps per second for each synthetic entity (default 1)\n"
+	     "  --blk-rate R         BLK edits per second (default 0)\n"
+	     "  --blk-size N         Cells changed per BLK (default 16)\n"
+	     "  --tile-kinds N       Different tiles in the tileset (default 32)\n"
+	     "  --sheets N           Tile sheets, all but the first are fetched with IMG (default 4)\n"
+	     "  --obj-density D      Chance of a cell having objects (default 0.1)\n"
+	     "  --keepalive S        Seconds between PINs (default 30)\n"
+	     "  --stats S            Seconds between stats lines, 0 for none (default 5)\n"
+	     "  --seed N             Random seed for the map and entities\n"
+	     "  --host NAME          Hostname to put in tile sheet URLs (default localhost)\n"
+	     "  --port P             Websocket port (default 8080)\n"
+	     "  --http-port P        Tile sheet port (default 8081)\n"
+	     "  --cert FILE --key FILE   Use TLS on the websocket port\n"
+	     "  --script FILE        Lines of \"seconds option value\" to change settings over time");
+}
+
+int main(int argc, char *argv[]) {
+	for(int i=1; i<argc; i++) {
+		if(strncmp(argv[i], "--", 2) || i+1 >= argc) {
+			usage();
+			return 1;
+		}
+		if(!strcmp(argv[i], "--script")) {
+			if(!load_script(argv[++i]))
+				return 1;
+		} else if(!set_option(argv[i]+2, argv[i+1])) {
+			usage();
+			return 1;
+		} else {
+			i++;
+		}
+	}
+	if(options.map_width < 1 || options.map_height < 1 || options.sheets < 1) {
+		usage();
+		return 1;
+	}
+	rng.seed(options.seed);
+	setvbuf(stdout, NULL, _IOLBF, 0); // Stats lines should show up promptly when logged to a file
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	use_tls = !options.cert_file.empty();
+	if(use_tls && !setup_tls())
+		return 1;
+
+	mbedtls_net_context websocket_listener, http_listener;
+	mbedtls_net_init(&websocket_listener);
+	mbedtls_net_init(&http_listener);
+	if(mbedtls_net_bind(&websocket_listener, NULL, options.port.c_str(), MBEDTLS_NET_PROTO_TCP) != 0) {
+		printf("Couldn't listen on port %s\n", options.port.c_str());
+		return 1;
+	}
+	if(mbedtls_net_bind(&http_listener, NULL, options.http_port.c_str(), MBEDTLS_NET_PROTO_TCP) != 0) {
+		printf("Couldn't listen on port %s\n", options.http_port.c_str());
+		return 1;
+	}
+	mbedtls_net_set_nonblock(&websocket_listener);
+	mbedtls_net_set_nonblock(&http_listener);
+
+	generate_map();
+	update_synthetic_entity_count();
+	printf("Listening for %s on port %s, tile sheets on port %s\n", use_tls ? "wss" : "ws", options.port.c_str(), options.http_port.c_str());
+	printf("%dx%d map, %d entities\n", town_map.width, town_map.height, options.entities);
+
+	uint64_t started_at = now_us();
+	uint64_t last_tick = started_at;
+	uint64_t last_stats = started_at;
+	double pending_steps = 0, pending_blk = 0;
+	std::vector<struct pollfd> fds;
+
+	while(!want_to_exit) {
+		fds.clear();
+		fds.push_back({websocket_listener.fd, POLLIN, 0});
+		fds.push_back({http_listener.fd, POLLIN, 0});
+		for(Connection *connection : connections) {
+			short events = POLLIN;
+			if(!connection->output.empty() || (connection->websocket && wslay_event_want_write(connection->websocket)) || (connection->tls && !connection->tls_ready))
+				events |= POLLOUT;
+			fds.push_back({connection->net.fd, events, 0});
+		}
+		poll(fds.data(), fds.size(), 5);
+
+		if(fds[0].revents & POLLIN)
+			accept_connections(&websocket_listener, true);
+		if(fds[1].revents & POLLIN)
+			accept_connections(&http_listener, false);
+		for(size_t i=2; i<fds.size(); i++) {
+			// Connections accepted this time around aren't in fds yet
+			if(fds[i].revents)
+				service_connection(connections[i-2], fds[i].revents);
+		}
+
+		// Run the script and the synthetic activity
+		uint64_t now = now_us();
+		double seconds = (now - started_at) / 1000000.0;
+		while(script_position < script.size() && script[script_position].time <= seconds) {
+			ScriptStep *step = &script[script_position++];
+			printf("%.1f: %s = %s\n", seconds, step->name.c_str(), step->value.c_str());
+			set_option(step->name.c_str(), step->value.c_str());
+			update_synthetic_entity_count();
+		}
+		double elapsed = (now - last_tick) / 1000000.0;
+		last_tick = now;
+		pending_steps += options.mov_rate * synthetic_ids.size() * elapsed;
+		pending_blk += options.blk_rate * elapsed;
+		for(; pending_steps >= 1; pending_steps--)
+			step_synthetic_entity();
+		for(; pending_blk >= 1; pending_blk--)
+			send_blk_storm();
+
+		for(Connection *connection : connections) {
+			if(connection->entity_id && options.keepalive && now - connection->last_ping > (uint64_t)options.keepalive * 1000000) {
+				connection->last_ping = now;
+				connection->awaiting_ping = true;
+				send_text(connection, "PIN");
+			}
+			// Try to get broadcasts out now, instead of waiting for the next poll()
+			if(connection->websocket && !connection->closed && wslay_event_want_write(connection->websocket) && wslay_event_send(connection->websocket))
+				close_connection(connection);
+		}
+
+		// Clean up closed connections
+		for(size_t i=0; i<connections.size(); ) {
+			if(connections[i]->closed) {
+				free_connection(connections[i]);
+				connections.erase(connections.begin() + i);
+			} else {
+				i++;
+			}
+		}
+
+		if(options.stats && now - last_stats > (uint64_t)options.stats * 1000000) {
+			double interval = (now - last_stats) / 1000000.0;
+			printf("%zu connections, %u connects, %.0f msg/s in, %.0f msg/s out, %.1f KB/s out\n", connections.size(), stats.connects,
+				stats.messages_in / interval, stats.messages_out / interval, stats.bytes_out / interval / 1024);
+			stats = ServerStats();
+			last_stats = now;
+		}
+	}
+
+	for(Connection *connection : connections)
+		free_connection(connection);
+	mbedtls_net_free(&websocket_listener);
+	mbedtls_net_free(&http_listener);
+	return 0;
+}
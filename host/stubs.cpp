@@ -0,0 +1,30 @@
+/*
+ * Tilemap Town client for 3DS
+ *
+ * Copyright (C) 2024 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "town.hpp"
+
+// Stand-ins for the parts of the 3DS frontend that the client core calls into
+
+// Login settings, normally from menu.cpp
+char login_username[256] = "";
+char login_password[256] = "";
+bool guest_login = true;
+
+// There's nobody to press a key, so just keep going
+void wait_for_key() {
+}
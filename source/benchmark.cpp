@@ -0,0 +1,579 @@
+/*
+ * Tilemap Town client for 3DS
+ *
+ * Copyright (C) 2024 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "town.hpp"
+#include "cJSON.h"
+#include <algorithm>
+
+// Microbenchmarks for the hot paths, printed to the console.
+// These use their own TilemapTownClient so they don't disturb the real connection.
+
+static void print_rate(const char *name, unsigned int count, uint64_t elapsed_us) {
+	if(!elapsed_us)
+		elapsed_us = 1;
+	printf("%-20s %7llu/s (%u in %llu ms)\n", name, (unsigned long long)count * 1000000 / elapsed_us, count, (unsigned long long)(elapsed_us / 1000));
+}
+
+// .-------------------------------------------------------
+// | Outbound serialization
+// '-------------------------------------------------------
+
+static void benchmark_outbound() {
+	const unsigned int count = 20000;
+	TilemapTownClient *client = new TilemapTownClient();
+
+	cJSON *json = cJSON_CreateObject();
+	cJSON_AddStringToObject(json, "text", "Hello everyone! This is a chat message of a fairly normal length.");
+	uint64_t start;
+
+	// How websocket_write used to work: print, concatenate, and then wslay copies it again
+	start = get_time_us();
+	for(unsigned int i=0; i<count; i++) {
+		char *as_string = cJSON_PrintUnformatted(json);
+		std::string command = "MSG";
+		std::string text = command + " " + std::string(as_string);
+		free(as_string);
+		void *queued = malloc(text.size());
+		memcpy(queued, text.c_str(), text.size());
+		free(queued);
+	}
+	print_rate("MSG, old path", count, get_time_us() - start);
+
+	// Printed straight into the lane buffer
+	start = get_time_us();
+	for(unsigned int i=0; i<count; i++) {
+		client->websocket_write("MSG", json);
+		if((i & 63) == 63)
+			client->reset_outbound();
+	}
+	print_rate("MSG, lane buffer", count, get_time_us() - start);
+	client->reset_outbound();
+
+	// MOV through cJSON, like move_player used to do
+	start = get_time_us();
+	for(unsigned int i=0; i<count; i++) {
+		cJSON *mov = cJSON_CreateObject();
+		int from_array[2] = {(int)i, 5};
+		int to_array[2] = {(int)i+1, 5};
+		cJSON_AddItemToObject(mov, "from", cJSON_CreateIntArray(from_array, 2));
+		cJSON_AddItemToObject(mov, "to", cJSON_CreateIntArray(to_array, 2));
+		cJSON_AddNumberToObject(mov, "dir", 0);
+		char *as_string = cJSON_PrintUnformatted(mov);
+		std::string text = std::string("MOV ") + std::string(as_string);
+		free(as_string);
+		cJSON_Delete(mov);
+	}
+	print_rate("MOV, cJSON", count, get_time_us() - start);
+
+	// MOV through the direct writer
+	start = get_time_us();
+	for(unsigned int i=0; i<count; i++) {
+		client->queue_step(i, 5, i+1, 5, 0);
+		client->flush_pending_move();
+		if((i & 63) == 63)
+			client->reset_outbound();
+	}
+	print_rate("MOV, direct", count, get_time_us() - start);
+
+	cJSON_Delete(json);
+	delete client;
+}
+
+// .-------------------------------------------------------
+// | Inbound MOV/WHO decoding
+// '-------------------------------------------------------
+
+static void benchmark_inbound() {
+	const unsigned int entity_count = 300;
+	const unsigned int count = 20000;
+	TilemapTownClient *client = new TilemapTownClient();
+
+	// Synthetic crowd, similar to what a busy map sends
+	std::vector<std::string> stream;
+	char buffer[256];
+	for(unsigned int i=0; i<entity_count; i++) {
+		snprintf(buffer, sizeof(buffer), "WHO {\"add\": {\"id\": %u, \"name\": \"Visitor %u\", \"pic\": [0, %u, 0], \"x\": %u, \"y\": %u, \"dir\": 2, \"in_user_list\": true}}", i+1, i+1, i % 8, i % 60, i / 60);
+		client->websocket_message(buffer, strlen(buffer));
+	}
+	for(unsigned int i=0; i<entity_count; i++) {
+		if(i % 10 == 9)
+			snprintf(buffer, sizeof(buffer), "WHO {\"update\": {\"id\": %u, \"typing\": true}}", i+1);
+		else
+			snprintf(buffer, sizeof(buffer), "MOV {\"id\": %u, \"to\": [%u, %u], \"dir\": %u}", i+1, (i+1) % 60, i / 60, (i*2) & 7);
+		stream.push_back(std::string(buffer));
+	}
+
+	const char *names[] = {"MOV/WHO, cJSON", "MOV/WHO, fast path"};
+	for(int fast=0; fast<2; fast++) {
+		client->disable_fast_path = !fast;
+		uint64_t start = get_time_us();
+		for(unsigned int i=0; i<count; i++) {
+			const std::string &message = stream[i % stream.size()];
+			client->websocket_message(message.c_str(), message.size());
+		}
+		print_rate(names[fast], count, get_time_us() - start);
+	}
+
+	delete client;
+}
+
+// .-------------------------------------------------------
+// | Entity culling
+// '-------------------------------------------------------
+
+static bool sort_entity_by_y_pos(Entity *a, Entity *b) {
+	return (a->y < b->y);
+}
+
+static void benchmark_entity_culling() {
+	const unsigned int entity_count = 300;
+	const unsigned int count = 2000;
+	TilemapTownClient *client = new TilemapTownClient();
+	client->town_map.init_map(128, 128);
+	client->rebuild_entity_grid();
+	for(unsigned int i=0; i<entity_count; i++) {
+		Entity *entity = client->entities.add(client->entities.intern(std::to_string(i)));
+		entity->x = (i * 37 + i / 16) % 128;
+		entity->y = (i * 91 + i / 3) % 128;
+		client->entity_grid.update(entity);
+	}
+	int camera_x = 40, camera_y = 40;
+	unsigned int visible = 0;
+
+	// How draw_map used to do it: every entity, sorted, then culled
+	uint64_t start = get_time_us();
+	for(unsigned int i=0; i<count; i++) {
+		std::vector<Entity*> sorted_entities;
+		for(EntitySlot &slot : client->entities.slots)
+			if(slot.present)
+				sorted_entities.push_back(&slot.entity);
+		std::sort(sorted_entities.begin(), sorted_entities.end(), sort_entity_by_y_pos);
+		visible = 0;
+		for(Entity *entity : sorted_entities)
+			if(entity->x >= camera_x-3 && entity->y >= camera_y-3 && entity->x <= camera_x+VIEW_WIDTH_TILES+3 && entity->y <= camera_y+VIEW_HEIGHT_TILES+3)
+				visible++;
+	}
+	print_rate("Entities, sort all", count, get_time_us() - start);
+
+	start = get_time_us();
+	for(unsigned int i=0; i<count*10; i++) {
+		client->entity_grid.query(camera_x-3, camera_y-3, camera_x+VIEW_WIDTH_TILES+3, camera_y+VIEW_HEIGHT_TILES+3, client->entity_draw_list);
+	}
+	print_rate("Entities, grid", count*10, get_time_us() - start);
+	printf("%u visible, %zu from the grid\n", visible, client->entity_draw_list.size());
+
+	delete client;
+}
+
+// .-------------------------------------------------------
+// | WHO list refresh
+// '-------------------------------------------------------
+
+static unsigned int count_ready_pics(TilemapTownClient *client) {
+	unsigned int ready = 0;
+	for(EntitySlot &slot : client->entities.slots)
+		if(slot.present && slot.entity.pic.ready_to_draw)
+			ready++;
+	return ready;
+}
+
+static void benchmark_who_refresh() {
+	const unsigned int entity_count = 300;
+	const unsigned int count = 200;
+	TilemapTownClient *client = new TilemapTownClient();
+	client->town_map.init_map(128, 128);
+	client->rebuild_entity_grid();
+
+	// A full town, where a few people have moved, left or shown up since the last list
+	std::vector<std::string> lists;
+	char buffer[256];
+	for(int variant=0; variant<2; variant++) {
+		std::string list = "WHO {\"you\": 1, \"list\": {";
+		for(unsigned int i=0; i<entity_count; i++) {
+			unsigned int id = (variant && i % 50 == 49) ? i + 1001 : i + 1;
+			unsigned int x = (variant && i % 20 == 0) ? (i + 1) % 128 : i % 128;
+			snprintf(buffer, sizeof(buffer), "%s\"%u\": {\"id\": %u, \"name\": \"Visitor %u\", \"pic\": [0, %u, 0], \"x\": %u, \"y\": %u, \"dir\": 2, \"in_user_list\": true}",
+				i ? ", " : "", id, id, id, i % 8, x, i / 128);
+			list += buffer;
+		}
+		list += "}}";
+		lists.push_back(list);
+	}
+
+	// How it used to go: throw everything away and build it again
+	unsigned int kept = 0;
+	uint64_t start = get_time_us();
+	for(unsigned int i=0; i<count; i++) {
+		for(EntitySlot &slot : client->entities.slots)
+			slot.entity.pic.ready_to_draw = true;
+		client->entities.clear();
+		client->rebuild_entity_grid();
+		const std::string &list = lists[i & 1];
+		client->websocket_message(list.c_str(), list.size());
+		kept = count_ready_pics(client);
+	}
+	print_rate("WHO list, rebuild", count, get_time_us() - start);
+	printf("%u of %zu textures kept\n", kept, client->entities.count);
+
+	// Compared against what's already there
+	start = get_time_us();
+	for(unsigned int i=0; i<count; i++) {
+		for(EntitySlot &slot : client->entities.slots)
+			slot.entity.pic.ready_to_draw = true;
+		const std::string &list = lists[i & 1];
+		client->websocket_message(list.c_str(), list.size());
+		kept = count_ready_pics(client);
+	}
+	print_rate("WHO list, diff", count, get_time_us() - start);
+	printf("%u of %zu textures kept\n", kept, client->entities.count);
+
+	delete client;
+}
+
+// .-------------------------------------------------------
+// | Pathfinding
+// '-------------------------------------------------------
+
+// With a nonzero range, targets are at most that far from the start, like tapping somewhere on the screen
+static void benchmark_pathfinding_map(const char *name, TownMap *map, unsigned int count, int range) {
+	PathFinder finder = PathFinder();
+	std::vector<uint8_t> directions;
+	uint32_t seed = 12345;
+	auto random = [&]() {
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 16) & 0x7fff;
+	};
+
+	unsigned int found = 0;
+	uint64_t total_expanded = 0, total_length = 0;
+	uint64_t start = get_time_us();
+	for(unsigned int i=0; i<count; i++) {
+		int from_x = random() % map->width, from_y = random() % map->height;
+		int to_x = random() % map->width, to_y = random() % map->height;
+		if(range) {
+			to_x = from_x + (int)(random() % (range * 2 + 1)) - range;
+			to_y = from_y + (int)(random() % (range * 2 + 1)) - range;
+		}
+		if(finder.find(map, from_x, from_y, to_x, to_y, directions))
+			found++;
+		total_expanded += finder.expanded;
+		total_length += directions.size();
+	}
+	print_rate(name, count, get_time_us() - start);
+	printf("%u of %u reached, %llu steps and %llu cells looked at on average\n", found, count,
+		(unsigned long long)(total_length / count), (unsigned long long)(total_expanded / count));
+}
+
+static void benchmark_pathfinding() {
+	const int size = 512;
+	// Only the collision data is needed, so this doesn't need any MapCells
+	TownMap map = TownMap();
+	map.width = size;
+	map.height = size;
+	uint32_t seed = 1;
+	auto random = [&]() {
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 16) & 0x7fff;
+	};
+
+	// Open field with scattered walls
+	map.collision.assign(size * size, CellCollision());
+	for(CellCollision &cell : map.collision)
+		if(random() % 100 < 15)
+			cell.walls = 255;
+	benchmark_pathfinding_map("Path, open, far", &map, 200, 0);
+	benchmark_pathfinding_map("Path, open, near", &map, 2000, VIEW_WIDTH_TILES / 2);
+
+	// Rooms connected by doorways, with one-sided walls (like fences) partway across them
+	map.collision.assign(size * size, CellCollision());
+	for(int y=0; y<size; y++) {
+		for(int x=0; x<size; x++) {
+			CellCollision &cell = map.collision[y * size + x];
+			if(x % 16 == 0 && y % 16 != 8)
+				cell.walls = 255;
+			else if(y % 16 == 0 && x % 16 != 8)
+				cell.walls = 255;
+			else if(y % 16 == 4 && x % 16 > 2 && x % 16 < 14)
+				cell.walls = 1 << 2; // Can't go down out of this cell
+			else if(random() % 100 < 5)
+				cell.walls = 255;
+		}
+	}
+	benchmark_pathfinding_map("Path, rooms, far", &map, 200, 0);
+	benchmark_pathfinding_map("Path, rooms, near", &map, 2000, VIEW_WIDTH_TILES / 2);
+}
+
+// .-------------------------------------------------------
+// | Custom tiles
+// '-------------------------------------------------------
+
+static void benchmark_custom_tiles() {
+	const int size = 64;
+	const int variants = 24;
+	const unsigned int count = 10;
+	TilemapTownClient *client = new TilemapTownClient();
+	client->town_map.init_map(size, size);
+
+	// Maps made out of JSON tiles instead of tileset keys, with a different set of them each time
+	std::vector<std::string> maps;
+	char buffer[256];
+	for(unsigned int i=0; i<count; i++) {
+		std::string map = "MAP {\"pos\": [0, 0, 63, 63], \"default\": \"grass\", \"turf\": [";
+		for(int cell=0; cell<size*size; cell++) {
+			int variant = (cell * 7 + cell / size) % variants;
+			snprintf(buffer, sizeof(buffer), "%s[%d, %d, {\"name\": \"floor %u\", \"pic\": [0, %d, %u], \"density\": %s}]",
+				cell ? ", " : "", cell % size, cell / size, i, variant, i, variant < 4 ? "true" : "false");
+			map += buffer;
+		}
+		map += "], \"obj\": []}";
+		maps.push_back(map);
+	}
+
+	uint64_t start = get_time_us();
+	for(unsigned int i=0; i<count; i++)
+		client->websocket_message(maps[i].c_str(), maps[i].size());
+	print_rate("Custom tile MAP", count, get_time_us() - start);
+
+	CustomTileStats *stats = &client->json_tileset.stats;
+	printf("%u uses of %u tiles (%.1fx), %zu KB saved, %u swept, %zu left\n", stats->references, stats->created,
+		(double)stats->references / stats->created, stats->bytes_saved / 1024, stats->swept, client->json_tileset.size());
+	delete client;
+}
+
+#ifdef __3DS__
+// .-------------------------------------------------------
+// | Drawing the map
+// '-------------------------------------------------------
+
+Tex3DS_SubTexture calc_subtexture(int width, int height, int tile_width, int tile_height, int tile_x, int tile_y);
+void draw_atom_with_autotile(TilemapTownClient *client, MapTileInfo *atom, int real_x, int real_y, float draw_x, float draw_y, bool obj, int tenth_of_second_counter);
+void fit_object_budget(DrawStats *stats);
+
+// Stands in for a tile sheet that's already been downloaded
+#define BENCHMARK_SHEET_URL "https://benchmark.invalid/tiles.png"
+
+static C3D_Tex *add_benchmark_texture(TilemapTownClient *client) {
+	LoadedTextureInfo texture_info = {};
+	texture_info.original_width = 512;
+	texture_info.original_height = 512;
+	C3D_Tex *texture = (C3D_Tex*)linearAlloc(sizeof(C3D_Tex));
+	C3D_TexInit(texture, 512, 512, GPU_RGBA8);
+	texture_info.texture[0][0] = texture;
+	texture_info.find_subtexture_tables();
+
+	// Half see-through, except that the tree is solid and the water has every other quadrant empty
+	std::vector<u32> pixels(512 * 512);
+	for(int y=0; y<512; y++) {
+		for(int x=0; x<512; x++) {
+			u32 alpha = 0x80;
+			if(x >= 12*16 && x < 13*16 && y < 16)
+				alpha = 0xff;
+			else if(x >= 8*16 && x < 12*16 && y >= 4*16 && y < 10*16 && ((x/8 + y/8) & 1))
+				alpha = 0;
+			pixels[y * 512 + x] = 0xffffff00 | alpha;
+		}
+	}
+	texture_info.find_opacity(pixels.data(), 512, 512, 512);
+	client->texture_for_url[BENCHMARK_SHEET_URL] = texture_info;
+	return texture;
+}
+
+static void free_benchmark_texture(C3D_Tex *texture) {
+	C3D_TexDelete(texture);
+	linearFree(texture);
+}
+
+static std::shared_ptr<MapTileInfo> benchmark_tile(TilemapTownClient *client, const char *name, int pic_x, int pic_y, int autotile_layout, int animation_frames, bool obj, bool over) {
+	MapTileInfo tile = MapTileInfo();
+	tile.meta = std::make_shared<MapTileMeta>();
+	tile.meta->key = name;
+	tile.meta->name = name;
+	tile.sheet = client->get_tile_sheet(BENCHMARK_SHEET_URL);
+	tile.pic_x = pic_x;
+	tile.pic_y = pic_y;
+	tile.autotile_layout = autotile_layout;
+	tile.animation_frames = animation_frames;
+	tile.animation_speed = 2;
+	tile.obj = obj;
+	tile.over = over;
+	client->define_tile(name, &tile);
+	return client->get_tile_by_key(name);
+}
+
+// Only the time spent in draw_map counts, not waiting on the GPU
+static void time_draw_map(const char *name, TilemapTownClient *client, C3D_RenderTarget *target, unsigned int frames) {
+	int width = client->town_map.width * 16 - 400, height = client->town_map.height * 16 - 240;
+	uint64_t drawing_us = 0;
+	for(unsigned int i=0; i<frames; i++) {
+		C3D_FrameBegin(C3D_FRAME_SYNCDRAW);
+		fit_object_budget(&client->draw_stats);
+		C2D_TargetClear(target, C2D_Color32(0, 0, 0, 255));
+		C2D_SceneBegin(target);
+		uint64_t start = get_time_us();
+		client->draw_map(i * 3 % width, i * 2 % height);
+		drawing_us += get_time_us() - start;
+		C3D_FrameEnd(0);
+	}
+	print_rate(name, frames, drawing_us);
+	printf("%llu us per frame, %zu bytes per tile\n", (unsigned long long)(drawing_us / frames), sizeof(MapTileInfo));
+	printf("%u quads and %u texture switches in the last frame, %u dropped\n", client->draw_stats.quads, client->draw_stats.texture_switches, client->draw_stats.dropped);
+	printf("%u empty quads and %u hidden tiles culled\n", client->draw_stats.empty_quads, client->draw_stats.hidden_tiles);
+}
+
+static void benchmark_draw_map() {
+	const int size = 64;
+	const unsigned int frames = 120;
+	TilemapTownClient *client = new TilemapTownClient();
+	client->town_map.init_map(size, size);
+
+	C3D_Tex *texture = add_benchmark_texture(client);
+	LoadedTextureInfo &texture_info = client->texture_for_url[BENCHMARK_SHEET_URL];
+
+	// Working out an autotile quadrant's subtexture, against looking it up
+	const unsigned int lookups = 100000;
+	float total = 0;
+	uint64_t start = get_time_us();
+	for(unsigned int i=0; i<lookups; i++) {
+		Tex3DS_SubTexture subtexture = calc_subtexture(512, 512, 8, 8, i & 63, (i >> 6) & 63);
+		total += subtexture.left;
+	}
+	print_rate("Subtexture, calc", lookups, get_time_us() - start);
+	C2D_Image image;
+	start = get_time_us();
+	for(unsigned int i=0; i<lookups; i++) {
+		if(texture_info.image_for_xy(&image, i & 63, (i >> 6) & 63, true))
+			total += image.subtex->left;
+	}
+	print_rate("Subtexture, table", lookups, get_time_us() - start);
+	if(total < 0) // Keeps the loops from being optimized out
+		puts("?");
+
+	// Every cell has something autotiled or animated, and a lot of them have objects on top
+	std::shared_ptr<MapTileInfo> grass = benchmark_tile(client, "grass", 0, 0, 0, 1, false, false);
+	std::shared_ptr<MapTileInfo> water = benchmark_tile(client, "water", 8, 4, 4, 2, false, false);
+	std::shared_ptr<MapTileInfo> road  = benchmark_tile(client, "road", 2, 2, 2, 1, false, false);
+	std::shared_ptr<MapTileInfo> fence = benchmark_tile(client, "fence", 4, 10, 1, 1, true, false);
+	std::shared_ptr<MapTileInfo> tree  = benchmark_tile(client, "tree", 12, 0, 0, 1, true, true);
+	uint32_t seed = 1;
+	auto random = [&]() {
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 16) & 0x7fff;
+	};
+	for(int y=0; y<size; y++) {
+		for(int x=0; x<size; x++) {
+			MapCell *cell = &client->town_map.cells[y * size + x];
+			if((x / 6 + y / 5) % 3 == 0)
+				cell->turf = MapTileReference(water);
+			else if(x % 8 == 3 || y % 8 == 5)
+				cell->turf = MapTileReference(road);
+			else
+				cell->turf = MapTileReference(grass);
+			if(random() % 3 == 0)
+				cell->objs.push_back(MapTileReference(fence));
+			if(random() % 8 == 0)
+				cell->objs.push_back(MapTileReference(tree));
+		}
+	}
+	client->map_received = true;
+	C3D_RenderTarget *target = C3D_RenderTargetCreate(240, 400, GPU_RB_RGBA8, GPU_RB_DEPTH24_STENCIL8);
+	time_draw_map("Draw map, dense", client, target, frames);
+
+	// Piles of objects on every cell, with half of them drawn over entities
+	for(MapCell &cell : client->town_map.cells) {
+		cell.objs.clear();
+		for(int i=0; i<6; i++)
+			cell.objs.push_back(MapTileReference((i & 1) ? tree : fence));
+	}
+	time_draw_map("Draw map, stacked", client, target, frames);
+
+	C3D_RenderTargetDelete(target);
+	delete client;
+	free_benchmark_texture(texture);
+}
+
+// Every layout, in each of the 16 combinations of matching neighbors, as turf and as an object
+static void benchmark_autotiling() {
+	const unsigned int count = 50;
+	TilemapTownClient *client = new TilemapTownClient();
+	client->town_map.init_map(16 * 3, 3);
+	C3D_Tex *texture = add_benchmark_texture(client);
+	std::shared_ptr<MapTileInfo> grass = benchmark_tile(client, "grass", 0, 0, 0, 1, false, false);
+	C3D_RenderTarget *target = C3D_RenderTargetCreate(240, 400, GPU_RB_RGBA8, GPU_RB_DEPTH24_STENCIL8);
+	char name[32];
+
+	for(int layout=0; layout<AUTOTILE_LAYOUT_UNKNOWN; layout++) {
+		for(int obj=0; obj<2; obj++) {
+			snprintf(name, sizeof(name), "autotile %d %d", layout, obj);
+			std::shared_ptr<MapTileInfo> tile = benchmark_tile(client, name, 8, 8, layout, 1, obj, false);
+
+			// Each neighborhood gets a 3x3 block, with the tile in the middle and on the sides that match
+			for(int mask=0; mask<16; mask++) {
+				for(int y=0; y<3; y++) {
+					for(int x=0; x<3; x++) {
+						MapCell *cell = &client->town_map.cells[y * client->town_map.width + mask * 3 + x];
+						cell->turf = MapTileReference(grass);
+						cell->objs.clear();
+						bool used = (x == 1 && y == 1)
+							|| (x == 0 && y == 1 && (mask & 1)) || (x == 2 && y == 1 && (mask & 2))
+							|| (x == 1 && y == 0 && (mask & 4)) || (x == 1 && y == 2 && (mask & 8));
+						if(used && obj)
+							cell->objs.push_back(MapTileReference(tile));
+						else if(used)
+							cell->turf = MapTileReference(tile);
+					}
+				}
+			}
+
+			C3D_FrameBegin(C3D_FRAME_SYNCDRAW);
+			C2D_TargetClear(target, C2D_Color32(0, 0, 0, 255));
+			C2D_SceneBegin(target);
+			uint64_t start = get_time_us();
+			for(unsigned int i=0; i<count; i++)
+				for(int mask=0; mask<16; mask++)
+					draw_atom_with_autotile(client, tile.get(), mask * 3 + 1, 1, mask * 16, 0, obj, 0);
+			client->draw_list.draw(&client->draw_stats);
+			uint64_t elapsed = get_time_us() - start;
+			C3D_FrameEnd(0);
+
+			snprintf(name, sizeof(name), "Autotile %d, %s", layout, obj ? "obj" : "turf");
+			print_rate(name, count * 16, elapsed);
+		}
+	}
+
+	C3D_RenderTargetDelete(target);
+	delete client;
+	free_benchmark_texture(texture);
+}
+#endif
+
+// --------------------------------------------------------
+
+void run_benchmarks() {
+	puts("Running benchmarks...");
+	benchmark_outbound();
+	benchmark_inbound();
+	benchmark_entity_culling();
+	benchmark_who_refresh();
+	benchmark_pathfinding();
+	benchmark_custom_tiles();
+	#ifdef __3DS__
+	benchmark_autotiling();
+	benchmark_draw_map();
+	#endif
+	puts("Done");
+}
@@ -0,0 +1,222 @@
+/*
+ * Tilemap Town client for 3DS
+ *
+ * Copyright (C) 2024 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "town.hpp"
+#include <algorithm>
+
+// Captures of the messages the server sent, which can be replayed without a connection.
+//
+// File format, all little endian:
+// "TTCAP1\n\0"
+// then for each message: [uint64 microseconds since the capture started][uint32 length][message text]
+
+static const char capture_magic[8] = {'T', 'T', 'C', 'A', 'P', '1', '\n', 0};
+
+// .-------------------------------------------------------
+// | Recording
+// '-------------------------------------------------------
+
+bool TilemapTownClient::start_capture(const char *filename) {
+	this->stop_capture();
+	FILE *file = fopen(filename, "wb");
+	if(!file) {
+		printf("Couldn't open capture file %s\n", filename);
+		return false;
+	}
+	fwrite(capture_magic, 1, sizeof(capture_magic), file);
+	this->capture_file = file;
+	this->capture_started_at = get_time_us();
+	return true;
+}
+
+void TilemapTownClient::stop_capture() {
+	if(!this->capture_file)
+		return;
+	fclose(this->capture_file);
+	this->capture_file = nullptr;
+}
+
+void TilemapTownClient::capture_message(const char *text, size_t length) {
+	uint64_t time = get_time_us() - this->capture_started_at;
+	uint32_t length32 = length;
+	fwrite(&time, sizeof(time), 1, this->capture_file);
+	fwrite(&length32, sizeof(length32), 1, this->capture_file);
+	fwrite(text, 1, length, this->capture_file);
+}
+
+// .-------------------------------------------------------
+// | Replay
+// '-------------------------------------------------------
+
+static void sleep_us(uint64_t us) {
+	#ifdef __3DS__
+	svcSleepThread(us * 1000);
+	#else
+	struct timespec delay = {(time_t)(us / 1000000), (long)(us % 1000000) * 1000};
+	nanosleep(&delay, NULL);
+	#endif
+}
+
+void TilemapTownClient::print_command_timing() {
+	std::vector<std::pair<int, CommandTiming*>> sorted;
+	for(auto & [command, timing] : this->command_timing)
+		sorted.push_back({command, &timing});
+	// Most expensive first
+	std::sort(sorted.begin(), sorted.end(), [](auto &a, auto &b) {
+		return a.second->parse_us + a.second->apply_us > b.second->parse_us + b.second->apply_us;
+	});
+
+	puts("cmd   count     bytes  parse ms  apply ms  us/msg  fast");
+	for(auto & [command, timing] : sorted) {
+		printf("%c%c%c %7u %9zu %9.1f %9.1f %7.1f %4u%%\n", command & 255, (command >> 8) & 255, (command >> 16) & 255,
+			timing->count, timing->bytes, timing->parse_us / 1000.0, timing->apply_us / 1000.0,
+			(double)(timing->parse_us + timing->apply_us) / timing->count, timing->fast_path * 100 / timing->count);
+	}
+}
+
+// Loads the whole thing at once, so file access isn't part of the timing
+static bool load_capture(const char *filename, std::vector<char> &data) {
+	FILE *file = fopen(filename, "rb");
+	if(!file) {
+		printf("Couldn't open capture file %s\n", filename);
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data.resize(size);
+	size_t read = fread(data.data(), 1, size, file);
+	fclose(file);
+	if(read != (size_t)size || size < (long)sizeof(capture_magic) || memcmp(data.data(), capture_magic, sizeof(capture_magic))) {
+		printf("%s isn't a capture file\n", filename);
+		return false;
+	}
+	return true;
+}
+
+// Feeds a capture through websocket_message with no network involved.
+// With realtime set the original gaps between messages are kept, otherwise it goes as fast as it can.
+int replay_capture(const char *filename, bool realtime, bool fast_path) {
+	std::vector<char> data;
+	if(!load_capture(filename, data))
+		return 0;
+	size_t size = data.size();
+
+	TilemapTownClient *client = new TilemapTownClient();
+	client->disable_fast_path = !fast_path;
+	client->time_commands = true;
+
+	unsigned int count = 0;
+	size_t total_bytes = 0;
+	size_t position = sizeof(capture_magic);
+	uint64_t start = get_time_us();
+	while(position + 12 <= size) {
+		uint64_t time;
+		uint32_t length;
+		memcpy(&time, &data[position], sizeof(time));
+		memcpy(&length, &data[position+8], sizeof(length));
+		position += 12;
+		if(position + length > size) {
+			puts("Capture is truncated");
+			break;
+		}
+
+		if(realtime) {
+			uint64_t now = get_time_us() - start;
+			if(time > now)
+				sleep_us(time - now);
+		}
+		client->websocket_message(&data[position], length);
+		position += length;
+		count++;
+		total_bytes += length;
+
+		// Replies have nowhere to go, so don't let them pile up
+		if((count & 255) == 0)
+			client->reset_outbound();
+	}
+	uint64_t elapsed = get_time_us() - start;
+	if(!elapsed)
+		elapsed = 1;
+
+	printf("Replayed %u messages, %zu bytes in %llu ms (%llu msg/s, %.2f MB/s)\n", count, total_bytes, (unsigned long long)(elapsed / 1000),
+		(unsigned long long)count * 1000000 / elapsed, (double)total_bytes / elapsed);
+	client->print_command_timing();
+	delete client;
+	return 1;
+}
+
+// .-------------------------------------------------------
+// | Checking the decoders
+// '-------------------------------------------------------
+
+bool update_decoders_agree(const char *text, size_t length, bool *checked);
+
+struct DecoderCheckCounts {
+	unsigned int checked, skipped, different;
+};
+
+static void check_message_decoders(const char *text, size_t length, DecoderCheckCounts *counts) {
+	// Look inside batches the same way websocket_message does
+	if(length > 4 && !memcmp(text, "BAT ", 4)) {
+		size_t base = 4;
+		for(size_t scan = 4; scan <= length; scan++) {
+			if(scan == length || text[scan] == '\n') {
+				check_message_decoders(text+base, scan-base, counts);
+				base = scan+1;
+			}
+		}
+		return;
+	}
+	if(length < 4 || (memcmp(text, "MOV ", 4) && memcmp(text, "WHO ", 4)))
+		return;
+
+	bool checked;
+	if(!update_decoders_agree(text, length, &checked)) {
+		counts->different++;
+		printf("Decoded differently: %.*s\n", (int)std::min(length, (size_t)200), text);
+	}
+	if(checked)
+		counts->checked++;
+	else
+		counts->skipped++;
+}
+
+// Runs every MOV and WHO in a capture through both the fast path and cJSON, and reports any that don't match
+int check_capture_decoders(const char *filename) {
+	std::vector<char> data;
+	if(!load_capture(filename, data))
+		return 0;
+
+	DecoderCheckCounts counts = {};
+	size_t position = sizeof(capture_magic);
+	while(position + 12 <= data.size()) {
+		uint32_t length;
+		memcpy(&length, &data[position+8], sizeof(length));
+		position += 12;
+		if(position + length > data.size()) {
+			puts("Capture is truncated");
+			break;
+		}
+		check_message_decoders(&data[position], length, &counts);
+		position += length;
+	}
+
+	printf("%u MOV and WHO messages compared, %u left to cJSON, %u decoded differently\n", counts.checked, counts.skipped, counts.different);
+	return counts.different == 0;
+}
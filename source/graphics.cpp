@@ -18,6 +18,8 @@
  */
 #include "town.hpp"
 #include <algorithm>
+#include <array>
+#include <map>
 #include <png.h>
 
 Tex3DS_SubTexture calc_subtexture(int width, int height, int tile_width, int tile_height, int tile_x, int tile_y) {
@@ -34,6 +36,60 @@ Tex3DS_SubTexture calc_subtexture(int width, int height, int tile_width, int til
 	return out;
 }
 
+// .-------------------------------------------------------
+// | Subtexture tables
+// '-------------------------------------------------------
+
+static std::map<std::pair<int, int>, SubTextureTable> subtexture_tables;
+
+static void fill_subtextures(std::vector<Tex3DS_SubTexture> &out, int width, int height, int size) {
+	int columns = width / size, rows = height / size;
+	out.resize(columns * rows);
+	for(int y=0; y<rows; y++)
+		for(int x=0; x<columns; x++)
+			out[y * columns + x] = calc_subtexture(width, height, size, size, x, y);
+}
+
+static const SubTextureTable *get_subtexture_table(int width, int height) {
+	auto it = subtexture_tables.find({width, height});
+	if(it != subtexture_tables.end())
+		return &(*it).second;
+
+	SubTextureTable *table = &subtexture_tables[{width, height}];
+	table->width = width;
+	table->height = height;
+	fill_subtextures(table->tiles, width, height, 16);
+	fill_subtextures(table->quadrants, width, height, 8);
+	fill_subtextures(table->frames, width, height, 32);
+	return table;
+}
+
+static inline const Tex3DS_SubTexture *find_subtexture(const std::vector<Tex3DS_SubTexture> &list, int columns, int rows, int x, int y) {
+	if(x < 0 || y < 0 || x >= columns || y >= rows)
+		return nullptr;
+	return &list[y * columns + x];
+}
+
+const Tex3DS_SubTexture *SubTextureTable::tile(int x, int y) const {
+	return find_subtexture(this->tiles, this->width / 16, this->height / 16, x, y);
+}
+
+const Tex3DS_SubTexture *SubTextureTable::quadrant(int x, int y) const {
+	return find_subtexture(this->quadrants, this->width / 8, this->height / 8, x, y);
+}
+
+const Tex3DS_SubTexture *SubTextureTable::frame(int x, int y) const {
+	return find_subtexture(this->frames, this->width / 32, this->height / 32, x, y);
+}
+
+void LoadedTextureInfo::find_subtexture_tables() {
+	for(int x=0; x<MULTI_TEXTURE_COLUMNS; x++)
+		for(int y=0; y<MULTI_TEXTURE_ROWS; y++)
+			this->subtextures[x][y] = this->texture[x][y] ? get_subtexture_table(this->texture[x][y]->width, this->texture[x][y]->height) : nullptr;
+}
+
+// --------------------------------------------------------
+
 static u32 next_power_of_two(u32 v) {
 	v--;
 	v |= v >> 1;
@@ -156,20 +212,79 @@ void http_png_callback(const char *url, uint8_t *memory, size_t size, TilemapTow
 	}
 
 	// Clean up
+	loaded_texture_info.find_opacity(linear_pixels, rounded_up_width, image.width, image.height);
 	linearFree(swizzled_pixels);
 	linearFree(linear_pixels);
 
+	loaded_texture_info.find_subtexture_tables();
 	client->texture_for_url[std::string(url)] = loaded_texture_info;
 	client->need_redraw = true;
 
 	//puts("Finished decoding texture");
 }
 
+// Sorts every 8x8 quadrant into empty, opaque, or neither by looking at the alpha of each pixel,
+// and then every 16x16 tile from the four quadrants it's made of. Pixels past the edge of the image count as empty.
+void LoadedTextureInfo::find_opacity(const u32 *pixels, int stride, int width, int height) {
+	int tile_columns = (width + 15) / 16;
+	int tile_rows    = (height + 15) / 16;
+	int quadrant_columns = tile_columns * 2;
+	int quadrant_rows    = tile_rows * 2;
+	this->quadrant_opacity.assign(quadrant_columns * quadrant_rows, TILE_TRANSLUCENT);
+	for(int qy=0; qy<quadrant_rows; qy++) {
+		for(int qx=0; qx<quadrant_columns; qx++) {
+			bool any_visible = false, all_solid = true;
+			for(int y=qy*8; y<qy*8+8; y++) {
+				if(y >= height) {
+					all_solid = false;
+					break;
+				}
+				for(int x=qx*8; x<qx*8+8; x++) {
+					if(x >= width) {
+						all_solid = false;
+						break;
+					}
+					u8 alpha = pixels[y*stride + x] & 0xff; // ABGR, so alpha is the first byte
+					any_visible |= alpha != 0;
+					all_solid &= alpha == 0xff;
+				}
+			}
+			this->quadrant_opacity[qy*quadrant_columns + qx] = !any_visible ? TILE_EMPTY : (all_solid ? TILE_OPAQUE : TILE_TRANSLUCENT);
+		}
+	}
+
+	this->opacity_columns = tile_columns;
+	this->tile_opacity.assign(tile_columns * tile_rows, TILE_TRANSLUCENT);
+	for(int ty=0; ty<tile_rows; ty++) {
+		for(int tx=0; tx<tile_columns; tx++) {
+			bool all_empty = true, all_opaque = true;
+			for(int i=0; i<4; i++) {
+				int qx = tx*2 + (i & 1), qy = ty*2 + (i >> 1);
+				uint8_t quadrant = this->quadrant_opacity[qy*quadrant_columns + qx];
+				all_empty &= quadrant == TILE_EMPTY;
+				all_opaque &= quadrant == TILE_OPAQUE;
+			}
+			this->tile_opacity[ty*tile_columns + tx] = all_empty ? TILE_EMPTY : (all_opaque ? TILE_OPAQUE : TILE_TRANSLUCENT);
+		}
+	}
+}
+
+enum TileOpacity LoadedTextureInfo::get_opacity(int tile_x, int tile_y, bool quadrant) const {
+	int columns = quadrant ? this->opacity_columns * 2 : this->opacity_columns;
+	const std::vector<uint8_t> &opacity = quadrant ? this->quadrant_opacity : this->tile_opacity;
+	if(tile_x < 0 || tile_y < 0 || tile_x >= columns)
+		return TILE_TRANSLUCENT;
+	size_t index = (size_t)tile_y * columns + tile_x;
+	if(index >= opacity.size())
+		return TILE_TRANSLUCENT;
+	return (enum TileOpacity)opacity[index];
+}
+
 bool string_is_http_url(std::string &url) {
 	return url.starts_with("https://") || url.starts_with("http://");
 }
 
-bool LoadedTextureInfo::image_for_xy(C2D_Image *image, Tex3DS_SubTexture *subtexture, int tile_x, int tile_y, bool quadrant) {
+bool LoadedTextureInfo::image_for_xy(C2D_Image *image, int tile_x, int tile_y, bool quadrant) {
 	int tile_x_16 = quadrant ? tile_x/2 : tile_x;
 	int tile_y_16 = quadrant ? tile_y/2 : tile_y;
 	int multi_texture_x = tile_x_16 / MULTI_TEXTURE_CELL_WIDTH_IN_TILES;
@@ -186,14 +301,13 @@ bool LoadedTextureInfo::image_for_xy(C2D_Image *image, Tex3DS_SubTexture *subtex
 	}
 	image->tex = texture;
 
+	const SubTextureTable *table = this->subtextures[multi_texture_x][multi_texture_y];
 	if(quadrant) {
-		*subtexture = calc_subtexture(texture->width, texture->height, 8,  8,  tile_x - (multi_texture_x * MULTI_TEXTURE_CELL_WIDTH_IN_TILES * 2), tile_y - (multi_texture_y * MULTI_TEXTURE_CELL_HEIGHT_IN_TILES*2));
-		image->subtex = subtexture;
+		image->subtex = table->quadrant(tile_x - (multi_texture_x * MULTI_TEXTURE_CELL_WIDTH_IN_TILES * 2), tile_y - (multi_texture_y * MULTI_TEXTURE_CELL_HEIGHT_IN_TILES*2));
 	} else {
-		*subtexture = calc_subtexture(texture->width, texture->height, 16, 16, tile_x - multi_texture_x * MULTI_TEXTURE_CELL_WIDTH_IN_TILES, tile_y - multi_texture_y * MULTI_TEXTURE_CELL_HEIGHT_IN_TILES);
-		image->subtex = subtexture;
+		image->subtex = table->tile(tile_x - multi_texture_x * MULTI_TEXTURE_CELL_WIDTH_IN_TILES, tile_y - multi_texture_y * MULTI_TEXTURE_CELL_HEIGHT_IN_TILES);
 	}
-	return true;
+	return image->subtex != nullptr;
 }
 
 LoadedTextureInfo* Pic::get_texture(TilemapTownClient *client) {
@@ -218,8 +332,13 @@ LoadedTextureInfo* Pic::get_texture(TilemapTownClient *client) {
 	if(it != client->texture_for_url.end()) {
 		this->ready_to_draw = true;
 		this->extra_info = &(*it).second; // Save this so we can get the original size later
-		this->extra_info->image_for_xy(&this->image, &this->subtexture, this->x, this->y, false);
-		// ^ Records the C2D_Image so Pic::get() can have it
+		// Record the C2D_Image so Pic::get() can have it, and the table that goes with its texture for picking out frames
+		if(this->extra_info->image_for_xy(&this->image, this->x, this->y, false)) {
+			this->subtextures = get_subtexture_table(this->image.tex->width, this->image.tex->height);
+		} else {
+			this->image = C2D_Image();
+			this->subtextures = nullptr;
+		}
 		return this->extra_info;
 	} else {
 		client->http.get(*real_url, http_png_callback, nullptr);
@@ -228,164 +347,118 @@ LoadedTextureInfo* Pic::get_texture(TilemapTownClient *client) {
 }
 
 C2D_Image* Pic::get(TilemapTownClient *client) {
+	if(!this->ready_to_draw && this->get_texture(client) == nullptr)
+		return nullptr;
+	return this->image.subtex ? &this->image : nullptr;
+}
+
+LoadedTextureInfo* TileSheet::get_texture(TilemapTownClient *client) {
 	if(this->ready_to_draw) {
-		return &this->image;
-	} else if(this->get_texture(client) != nullptr) {
-		return &this->image;
+		return this->texture;
+	}
+	if(this->key.empty())
+		return nullptr;
+
+	// Try to turn a key into a URL if needed
+	std::string *real_url = &this->key;
+	if(!string_is_http_url(this->key)) {
+		auto it2 = client->url_for_tile_sheet.find(this->key);
+		if(it2 != client->url_for_tile_sheet.end()) {
+			real_url = &(*it2).second;
+		} else {
+			client->request_image_asset(this->key);
+			return nullptr;
+		}
+	}
+
+	// If it's already a loaded texture, get it
+	auto it = client->texture_for_url.find(*real_url);
+	if(it != client->texture_for_url.end()) {
+		this->ready_to_draw = true;
+		this->texture = &(*it).second;
+		return this->texture;
+	} else {
+		client->http.get(*real_url, http_png_callback, nullptr);
+		return nullptr;
 	}
-	return nullptr;
 }
 
-bool sort_entity_by_y_pos(Entity *a, Entity *b) {
-    return (a->y < b->y);
+static LoadedTextureInfo *get_tile_texture(TilemapTownClient *client, MapTileInfo *tile) {
+	if(tile->sheet >= client->tile_sheets.size())
+		return nullptr;
+	return client->tile_sheets[tile->sheet].get_texture(client);
 }
 
 void draw_atom_with_pic_offset(TilemapTownClient *client, MapTileInfo *turf, int offset_x, int offset_y, float draw_x, float draw_y) {
-	LoadedTextureInfo *texture_info = turf->pic.get_texture(client);
+	LoadedTextureInfo *texture_info = get_tile_texture(client, turf);
 	if(!texture_info)
 		return;
 
+	int tile_x = turf->pic_x + offset_x, tile_y = turf->pic_y + offset_y;
+	if(texture_info->get_opacity(tile_x, tile_y, false) == TILE_EMPTY) {
+		client->draw_list.empty_quads++;
+		return;
+	}
+
 	C2D_Image image;
-	Tex3DS_SubTexture subtexture;
-	bool result = texture_info->image_for_xy(&image, &subtexture, turf->pic.x + offset_x, turf->pic.y + offset_y, false);
+	bool result = texture_info->image_for_xy(&image, tile_x, tile_y, false);
 	if(!result)
 		return;
-	C2D_DrawImageAt(image, draw_x, draw_y, 0, NULL, 1.0f, -1.0f);
+	client->draw_list.add(image, draw_x, draw_y);
 }
 
 void draw_atom_quadrant_with_pic_offset(TilemapTownClient *client, MapTileInfo *turf, int offset_x, int offset_y, float draw_x, float draw_y) {
-	LoadedTextureInfo *texture_info = turf->pic.get_texture(client);
+	LoadedTextureInfo *texture_info = get_tile_texture(client, turf);
 	if(!texture_info)
 		return;
 
+	int tile_x = turf->pic_x*2 + offset_x, tile_y = turf->pic_y*2 + offset_y;
+	if(texture_info->get_opacity(tile_x, tile_y, true) == TILE_EMPTY) {
+		client->draw_list.empty_quads++;
+		return;
+	}
+
 	C2D_Image image;
-	Tex3DS_SubTexture subtexture;
-	bool result = texture_info->image_for_xy(&image, &subtexture, turf->pic.x*2 + offset_x, turf->pic.y*2 + offset_y, true);
+	bool result = texture_info->image_for_xy(&image, tile_x, tile_y, true);
 	if(!result)
 		return;
-	C2D_DrawImageAt(image, draw_x, draw_y, 0, NULL, 1.0f, -1.0f);
+	client->draw_list.add(image, draw_x, draw_y);
 }
 
-void draw_atom_with_autotile(TilemapTownClient *client, MapTileInfo *atom, int real_x, int real_y, float draw_x, float draw_y, bool obj, int tenth_of_second_counter) {
+// .-------------------------------------------------------
+// | Autotiling
+// '-------------------------------------------------------
+
+static int get_animation_frame(MapTileInfo *atom, int tenth_of_second_counter) {
+	if(atom->animation_frames <= 1)
+		return 0;
 	int animation_frame = 0;
-	if(atom->animation_frames > 1) {
-		int animation_frame_count = atom->animation_frames;
-		int animation_timer = tenth_of_second_counter + atom->animation_offset;
-		int animation_speed = atom->animation_speed;
-
-		switch(atom->animation_mode) {
-			case 0: // Forwards
-				animation_frame = animation_timer / animation_speed % animation_frame_count;
-				break;
-			case 1: // Backwards
-				animation_frame = animation_frame_count - 1 - (animation_timer / animation_speed % animation_frame_count);
-				break;
-			case 2: // Ping-pong forwards
-			case 3: // Ping-pong backwards
-			{
-				animation_frame_count--;
-				int sub_animation_frame = animation_timer / animation_speed % animation_frame_count;
-				bool is_backwards = (animation_timer / animation_speed / animation_frame_count) & 1;
-				if(is_backwards ^ (atom->animation_mode == 3)) {
-					animation_frame = animation_frame_count - sub_animation_frame;
-				} else {
-					animation_frame = sub_animation_frame;
-				}
-				break;
-			}
-		}
-	}
+	int animation_frame_count = atom->animation_frames;
+	int animation_timer = tenth_of_second_counter + atom->animation_offset;
+	int animation_speed = atom->animation_speed;
 
-	switch(atom->autotile_layout) {
-		default:
-		{
-			C2D_Image *image = atom->pic.get(client);
-			if(image) {
-				C2D_DrawImageAt(*image, draw_x, draw_y, 0, NULL, 1.0f, -1.0f);
-			}
-			break;
-		}
-		case 0: // No autotiling
-		{
-			if(animation_frame == 0) {
-				C2D_Image *image = atom->pic.get(client);
-				if(image) {
-					C2D_DrawImageAt(*image, draw_x, draw_y, 0, NULL, 1.0f, -1.0f);
-				}
-			} else {
-				draw_atom_with_pic_offset(client, atom, animation_frame, 0, draw_x, draw_y);
-			}
+	switch(atom->animation_mode) {
+		case 0: // Forwards
+			animation_frame = animation_timer / animation_speed % animation_frame_count;
 			break;
-		}
-		case 1: // 4-direction autotiling, 9 tiles, origin is middle
-		{
-			unsigned int autotile_index = obj ? client->get_obj_autotile_index_4(atom, real_x, real_y) : client->get_turf_autotile_index_4(atom, real_x, real_y);
-			const static int offset_x_list[] = {0,0,0,0,   0,1,-1,0,    0, 1,-1, 0,  0,1,-1,0};
-			const static int offset_y_list[] = {0,0,0,0,   0,1, 1,1,    0,-1,-1,-1,  0,0, 0,0};
-			draw_atom_with_pic_offset(client, atom, offset_x_list[autotile_index] + animation_frame * 3, offset_y_list[autotile_index], draw_x, draw_y);
+		case 1: // Backwards
+			animation_frame = animation_frame_count - 1 - (animation_timer / animation_speed % animation_frame_count);
 			break;
-		}
-		case 2: // 4-direction autotiling, 9 tiles, origin is middle, horizonal & vertical & single as separate tiles
-		case 3: // Same as 2, but origin point is single
+		case 2: // Ping-pong forwards
+		case 3: // Ping-pong backwards
 		{
-			unsigned int autotile_index = obj ? client->get_obj_autotile_index_4(atom, real_x, real_y) : client->get_turf_autotile_index_4(atom, real_x, real_y);
-			const static int offset_x_list[] = { 2,1,-1,0};
-			const static int offset_y_list[] = {-2,1,-1,0};
-			bool isThree = atom->autotile_layout == 3;
-			draw_atom_with_pic_offset(client, atom, offset_x_list[autotile_index&3] - (isThree?2:0) + animation_frame * 4, offset_y_list[autotile_index>>2] + (isThree?2:0), draw_x, draw_y);
-			break;
-		}
-		case 4: // 8-direction autotiling, origin point is middle
-		case 5: // 8-direction autotiling, origin point is single
-		{
-			unsigned int autotile_index = obj ? client->get_obj_autotile_index_4(atom, real_x, real_y) : client->get_turf_autotile_index_4(atom, real_x, real_y);
-			const static int offset_0x[] = {-2, 2,-2, 0,-2, 2,-2, 0,-2, 2,-2, 0,-2, 2,-2, 0};
-			const static int offset_0y[] = {-4,-2,-2,-2, 2, 2, 2, 2,-2,-2,-2,-2, 0, 0, 0, 0};
-			const static int offset_1x[] = {-1, 3,-1, 1, 3, 3,-1, 1, 3, 3,-1, 1, 3, 3,-1, 1};
-			const static int offset_1y[] = {-4,-2,-2,-2, 2, 2, 2, 2,-2,-2,-2,-2, 0, 0, 0, 0};
-			const static int offset_2x[] = {-2, 2,-2, 0,-2, 2,-2, 0,-2, 2,-2, 0,-2, 2,-2, 0};
-			const static int offset_2y[] = {-3, 3, 3, 3, 3, 3, 3, 3,-1,-1,-1,-1, 1, 1, 1, 1};
-			const static int offset_3x[] = {-1, 3,-1, 1, 3, 3,-1, 1, 3, 3,-1, 1, 3, 3,-1, 1};
-			const static int offset_3y[] = {-3, 3, 3, 3, 3, 3, 3, 3,-1,-1,-1,-1, 1, 1, 1, 1};
-
-			int t0x = offset_0x[autotile_index], t0y = offset_0y[autotile_index];
-			int t1x = offset_1x[autotile_index], t1y = offset_1y[autotile_index];
-			int t2x = offset_2x[autotile_index], t2y = offset_2y[autotile_index];
-			int t3x = offset_3x[autotile_index], t3y = offset_3y[autotile_index];
-			
-			// Add the inner parts of turns
-			if(((autotile_index &  5) ==  5)
-			&& !(obj ? client->is_obj_autotile_match(atom, real_x-1, real_y-1) : client->is_turf_autotile_match(atom, real_x-1, real_y-1))) {
-				t0x = 2; t0y = -4;
-			}
-			if(((autotile_index &  6) ==  6)
-			&& !(obj ? client->is_obj_autotile_match(atom, real_x+1, real_y-1) : client->is_turf_autotile_match(atom, real_x+1, real_y-1))) {
-				t1x = 3; t1y = -4;
-			}
-			if(((autotile_index &  9) ==  9)
-			&& !(obj ? client->is_obj_autotile_match(atom, real_x-1, real_y+1) : client->is_turf_autotile_match(atom, real_x-1, real_y+1))) {
-				t2x = 2; t2y = -3;
-			}
-			if(((autotile_index & 10) == 10)
-			&& !(obj ? client->is_obj_autotile_match(atom, real_x+1, real_y+1) : client->is_turf_autotile_match(atom, real_x+1, real_y+1))) {
-				t3x = 3; t3y = -3;
-			}
-
-			// For 4 the origin point is on the single tile instead of the all-connected tile
-			if(atom->autotile_layout == 5) {
-				t0x += 2; t1x += 2; t2x += 2; t3x += 2;
-				t0y += 4; t1y += 4; t2y += 4; t3y += 4;
+			animation_frame_count--;
+			int sub_animation_frame = animation_timer / animation_speed % animation_frame_count;
+			bool is_backwards = (animation_timer / animation_speed / animation_frame_count) & 1;
+			if(is_backwards ^ (atom->animation_mode == 3)) {
+				animation_frame = animation_frame_count - sub_animation_frame;
+			} else {
+				animation_frame = sub_animation_frame;
 			}
-
-			// Draw the four tiles
-			animation_frame *= 6;
-			draw_atom_quadrant_with_pic_offset(client, atom, t0x + animation_frame, t0y, draw_x,   draw_y  );
-			draw_atom_quadrant_with_pic_offset(client, atom, t1x + animation_frame, t1y, draw_x+8, draw_y  );
-			draw_atom_quadrant_with_pic_offset(client, atom, t2x + animation_frame, t2y, draw_x,   draw_y+8);
-			draw_atom_quadrant_with_pic_offset(client, atom, t3x + animation_frame, t3y, draw_x+8, draw_y+8);
 			break;
 		}
 	}
+	return animation_frame;
 }
 
 bool TilemapTownClient::is_turf_autotile_match(MapTileInfo *turf, int x, int y) {
@@ -393,11 +466,13 @@ bool TilemapTownClient::is_turf_autotile_match(MapTileInfo *turf, int x, int y)
 	if(x < 0 || x >= this->town_map.width || y < 0 || y >= this->town_map.height)
 		return true;
 	MapTileInfo *other = this->town_map.cells[y * this->town_map.width + x].turf.get(this);
+	if(!other)
+		return false;
 
 	if(turf->autotile_class)
 		return turf->autotile_class == other->autotile_class;
-	if(!turf->name.empty())
-		return turf->name == other->name;
+	if(turf->autotile_name)
+		return turf->autotile_name == other->autotile_name;
 	return false;
 }
 
@@ -413,29 +488,22 @@ bool TilemapTownClient::is_obj_autotile_match(MapTileInfo *obj, int x, int y) {
 		if(obj->autotile_class) {
 			if(obj->autotile_class == other_obj->autotile_class)
 				return true;
-		} else if(!obj->name.empty()) {
-			if(obj->name == other_obj->name)
+		} else if(obj->autotile_name) {
+			if(obj->autotile_name == other_obj->autotile_name)
 				return true;
 		}
 	}
 	return false;
 }
 
-unsigned int TilemapTownClient::get_turf_autotile_index_4(MapTileInfo *turf, int x, int y) {
-	/* Check on the four adjacent tiles and see if they "match", to get an index for an autotile lookup table.
-		Will result in one of the following:
-		 0 durl  1 durL  2 duRl  3 duRL
-		 4 dUrl  5 dUrL  6 dURl  7 dURL
-		 8 Durl  9 DurL 10 DuRl 11 DuRL
-		12 DUrl 13 DUrL 14 DURl 15 DURL
-	*/
-	return (this->is_turf_autotile_match(turf, x-1, y) << 0)
-	     | (this->is_turf_autotile_match(turf, x+1, y) << 1)
-	     | (this->is_turf_autotile_match(turf, x, y-1) << 2)
-	     | (this->is_turf_autotile_match(turf, x, y+1) << 3);
+template<bool obj> static inline bool is_autotile_match(TilemapTownClient *client, MapTileInfo *atom, int x, int y) {
+	if constexpr(obj)
+		return client->is_obj_autotile_match(atom, x, y);
+	else
+		return client->is_turf_autotile_match(atom, x, y);
 }
 
-unsigned int TilemapTownClient::get_obj_autotile_index_4(MapTileInfo *turf, int x, int y) {
+template<bool obj> static unsigned int get_autotile_index_4(TilemapTownClient *client, MapTileInfo *atom, int x, int y) {
 	/* Check on the four adjacent tiles and see if they "match", to get an index for an autotile lookup table.
 		Will result in one of the following:
 		 0 durl  1 durL  2 duRl  3 duRL
@@ -443,12 +511,210 @@ unsigned int TilemapTownClient::get_obj_autotile_index_4(MapTileInfo *turf, int
 		 8 Durl  9 DurL 10 DuRl 11 DuRL
 		12 DUrl 13 DUrL 14 DURl 15 DURL
 	*/
-	return (this->is_obj_autotile_match(turf, x-1, y) << 0)
-	     | (this->is_obj_autotile_match(turf, x+1, y) << 1)
-	     | (this->is_obj_autotile_match(turf, x, y-1) << 2)
-	     | (this->is_obj_autotile_match(turf, x, y+1) << 3);
+	return (is_autotile_match<obj>(client, atom, x-1, y) << 0)
+	     | (is_autotile_match<obj>(client, atom, x+1, y) << 1)
+	     | (is_autotile_match<obj>(client, atom, x, y-1) << 2)
+	     | (is_autotile_match<obj>(client, atom, x, y+1) << 3);
+}
+
+struct AutotileOffset {
+	int8_t x, y;
+};
+
+// Offset from the tile's pic for each autotile index, for layouts 1-3
+template<int layout> static constexpr std::array<AutotileOffset, 16> make_autotile_offsets_4() {
+	std::array<AutotileOffset, 16> out = {};
+	for(int i=0; i<16; i++) {
+		if constexpr(layout == 1) { // 9 tiles, origin is middle
+			const int offset_x_list[] = {0,0,0,0,   0,1,-1,0,    0, 1,-1, 0,  0,1,-1,0};
+			const int offset_y_list[] = {0,0,0,0,   0,1, 1,1,    0,-1,-1,-1,  0,0, 0,0};
+			out[i] = {(int8_t)offset_x_list[i], (int8_t)offset_y_list[i]};
+		} else { // 2 is the same but with horizontal & vertical & single as separate tiles, and 3 has the origin point on single
+			const int offset_x_list[] = { 2,1,-1,0};
+			const int offset_y_list[] = {-2,1,-1,0};
+			bool is_three = layout == 3;
+			out[i] = {(int8_t)(offset_x_list[i&3] - (is_three?2:0)), (int8_t)(offset_y_list[i>>2] + (is_three?2:0))};
+		}
+	}
+	return out;
+}
+
+// Offsets for the four quadrants in layouts 4 and 5, for each autotile index combined with four more bits
+// for which corners need the inner part of a turn. The quadrants are top left, top right, bottom left, bottom right.
+template<int layout> static constexpr std::array<std::array<AutotileOffset, 4>, 256> make_autotile_offsets_8() {
+	const int offset_0x[] = {-2, 2,-2, 0,-2, 2,-2, 0,-2, 2,-2, 0,-2, 2,-2, 0};
+	const int offset_0y[] = {-4,-2,-2,-2, 2, 2, 2, 2,-2,-2,-2,-2, 0, 0, 0, 0};
+	const int offset_1x[] = {-1, 3,-1, 1, 3, 3,-1, 1, 3, 3,-1, 1, 3, 3,-1, 1};
+	const int offset_1y[] = {-4,-2,-2,-2, 2, 2, 2, 2,-2,-2,-2,-2, 0, 0, 0, 0};
+	const int offset_2x[] = {-2, 2,-2, 0,-2, 2,-2, 0,-2, 2,-2, 0,-2, 2,-2, 0};
+	const int offset_2y[] = {-3, 3, 3, 3, 3, 3, 3, 3,-1,-1,-1,-1, 1, 1, 1, 1};
+	const int offset_3x[] = {-1, 3,-1, 1, 3, 3,-1, 1, 3, 3,-1, 1, 3, 3,-1, 1};
+	const int offset_3y[] = {-3, 3, 3, 3, 3, 3, 3, 3,-1,-1,-1,-1, 1, 1, 1, 1};
+	const int inner_x[] = {2, 3, 2, 3};
+	const int inner_y[] = {-4, -4, -3, -3};
+
+	std::array<std::array<AutotileOffset, 4>, 256> out = {};
+	for(int i=0; i<256; i++) {
+		int index = i & 15;
+		int t[4][2] = {
+			{offset_0x[index], offset_0y[index]},
+			{offset_1x[index], offset_1y[index]},
+			{offset_2x[index], offset_2y[index]},
+			{offset_3x[index], offset_3y[index]},
+		};
+		for(int quadrant=0; quadrant<4; quadrant++) {
+			if(i & (16 << quadrant)) {
+				t[quadrant][0] = inner_x[quadrant];
+				t[quadrant][1] = inner_y[quadrant];
+			}
+			// For 5 the origin point is on the single tile instead of the all-connected tile
+			if(layout == 5) {
+				t[quadrant][0] += 2;
+				t[quadrant][1] += 4;
+			}
+			out[i][quadrant] = {(int8_t)t[quadrant][0], (int8_t)t[quadrant][1]};
+		}
+	}
+	return out;
+}
+
+template<int layout> static constexpr std::array<AutotileOffset, 16> autotile_offsets_4 = make_autotile_offsets_4<layout>();
+template<int layout> static constexpr std::array<std::array<AutotileOffset, 4>, 256> autotile_offsets_8 = make_autotile_offsets_8<layout>();
+
+// One of these for each layout and layer, so none of that has to be checked for every cell
+typedef void (*AutotileRoutine)(TilemapTownClient *client, MapTileInfo *atom, int real_x, int real_y, float draw_x, float draw_y, int animation_frame);
+
+static void draw_autotile_unknown(TilemapTownClient *client, MapTileInfo *atom, int real_x, int real_y, float draw_x, float draw_y, int animation_frame) {
+	draw_atom_with_pic_offset(client, atom, 0, 0, draw_x, draw_y);
+}
+
+// No autotiling
+static void draw_autotile_none(TilemapTownClient *client, MapTileInfo *atom, int real_x, int real_y, float draw_x, float draw_y, int animation_frame) {
+	draw_atom_with_pic_offset(client, atom, animation_frame, 0, draw_x, draw_y);
+}
+
+// 4-direction autotiling
+template<int layout, bool obj> static void draw_autotile_4(TilemapTownClient *client, MapTileInfo *atom, int real_x, int real_y, float draw_x, float draw_y, int animation_frame) {
+	constexpr int frame_width = (layout == 1) ? 3 : 4;
+	AutotileOffset offset = autotile_offsets_4<layout>[get_autotile_index_4<obj>(client, atom, real_x, real_y)];
+	draw_atom_with_pic_offset(client, atom, offset.x + animation_frame * frame_width, offset.y, draw_x, draw_y);
 }
 
+// 8-direction autotiling
+template<int layout, bool obj> static void draw_autotile_8(TilemapTownClient *client, MapTileInfo *atom, int real_x, int real_y, float draw_x, float draw_y, int animation_frame) {
+	unsigned int index = get_autotile_index_4<obj>(client, atom, real_x, real_y);
+
+	// Add the inner parts of turns
+	if(((index &  5) ==  5) && !is_autotile_match<obj>(client, atom, real_x-1, real_y-1))
+		index |= 16;
+	if(((index &  6) ==  6) && !is_autotile_match<obj>(client, atom, real_x+1, real_y-1))
+		index |= 32;
+	if(((index &  9) ==  9) && !is_autotile_match<obj>(client, atom, real_x-1, real_y+1))
+		index |= 64;
+	if(((index & 10) == 10) && !is_autotile_match<obj>(client, atom, real_x+1, real_y+1))
+		index |= 128;
+
+	// Draw the four tiles
+	const std::array<AutotileOffset, 4> &offsets = autotile_offsets_8<layout>[index];
+	animation_frame *= 6;
+	draw_atom_quadrant_with_pic_offset(client, atom, offsets[0].x + animation_frame, offsets[0].y, draw_x,   draw_y  );
+	draw_atom_quadrant_with_pic_offset(client, atom, offsets[1].x + animation_frame, offsets[1].y, draw_x+8, draw_y  );
+	draw_atom_quadrant_with_pic_offset(client, atom, offsets[2].x + animation_frame, offsets[2].y, draw_x,   draw_y+8);
+	draw_atom_quadrant_with_pic_offset(client, atom, offsets[3].x + animation_frame, offsets[3].y, draw_x+8, draw_y+8);
+}
+
+// Turf first, then objects, each indexed by autotile layout
+static const AutotileRoutine autotile_routines[2][AUTOTILE_LAYOUT_COUNT] = {
+	{draw_autotile_none, draw_autotile_4<1, false>, draw_autotile_4<2, false>, draw_autotile_4<3, false>, draw_autotile_8<4, false>, draw_autotile_8<5, false>, draw_autotile_unknown},
+	{draw_autotile_none, draw_autotile_4<1, true>,  draw_autotile_4<2, true>,  draw_autotile_4<3, true>,  draw_autotile_8<4, true>,  draw_autotile_8<5, true>,  draw_autotile_unknown},
+};
+
+void draw_atom_with_autotile(TilemapTownClient *client, MapTileInfo *atom, int real_x, int real_y, float draw_x, float draw_y, bool obj, int tenth_of_second_counter) {
+	autotile_routines[obj][atom->autotile_layout](client, atom, real_x, real_y, draw_x, draw_y, get_animation_frame(atom, tenth_of_second_counter));
+}
+
+// Whether the tile an object is going to draw this frame is completely solid, hiding everything under it in the cell.
+// Autotiled objects aren't checked, because which tiles they use depends on what's around them.
+static bool atom_covers_cell(TilemapTownClient *client, MapTileInfo *atom, int tenth_of_second_counter) {
+	if(atom->autotile_layout != 0 && atom->autotile_layout != AUTOTILE_LAYOUT_UNKNOWN)
+		return false;
+	LoadedTextureInfo *texture_info = get_tile_texture(client, atom);
+	if(!texture_info)
+		return false;
+	int animation_frame = atom->autotile_layout == 0 ? get_animation_frame(atom, tenth_of_second_counter) : 0;
+	return texture_info->get_opacity(atom->pic_x + animation_frame, atom->pic_y, false) == TILE_OPAQUE;
+}
+
+// .-------------------------------------------------------
+// | Batching
+// '-------------------------------------------------------
+
+// citro2d's buffer is sized when it starts up, so main() starts it with this and fit_object_budget() can make it bigger
+unsigned int object_budget = C2D_DEFAULT_MAX_OBJECTS;
+#define MAX_OBJECT_BUDGET 32768
+
+void TileDrawList::add(const C2D_Image &image, float x, float y) {
+	this->layers[this->layer].push_back({image.tex, image.subtex, x, y, this->depth});
+}
+
+void TileDrawList::draw(DrawStats *stats) {
+	stats->quads = 0;
+	stats->texture_switches = 0;
+	stats->dropped = 0;
+	stats->empty_quads = this->empty_quads;
+	stats->hidden_tiles = this->hidden_tiles;
+	this->empty_quads = 0;
+	this->hidden_tiles = 0;
+	C3D_Tex *last_texture = nullptr;
+
+	for(int layer=0; layer<DRAW_LAYER_COUNT; layer++) {
+		std::vector<TileQuad> &quads = this->layers[layer];
+		// Entities each get their own depth and are added in order, so they're already sorted
+		if(layer != DRAW_LAYER_ENTITIES) {
+			std::sort(quads.begin(), quads.end(), [](const TileQuad &a, const TileQuad &b) {
+				if(a.depth != b.depth)
+					return a.depth < b.depth;
+				return (uintptr_t)a.texture < (uintptr_t)b.texture;
+			});
+		}
+
+		stats->quads += quads.size();
+		for(TileQuad &quad : quads) {
+			if(quad.texture != last_texture) {
+				stats->texture_switches++;
+				last_texture = quad.texture;
+			}
+			C2D_Image image = {quad.texture, quad.subtexture};
+			if(!C2D_DrawImageAt(image, quad.x, quad.y, 0, NULL, 1.0f, -1.0f))
+				stats->dropped++;
+		}
+		quads.clear();
+	}
+}
+
+// Making the buffer bigger means starting citro2d up again, which frees the vertex buffer and shader the GPU reads from.
+// So this has to go right after C3D_FrameBegin, which waits for the GPU to finish the last frame, and before the scene begins.
+void fit_object_budget(DrawStats *stats) {
+	if(stats->quads <= object_budget || object_budget >= MAX_OBJECT_BUDGET)
+		return;
+	unsigned int budget = object_budget;
+	while(budget < stats->quads && budget < MAX_OBJECT_BUDGET)
+		budget *= 2;
+	C2D_Fini();
+	C2D_Init(budget);
+	C2D_Prepare();
+	object_budget = budget;
+	stats->budget_increases++;
+}
+
+void TilemapTownClient::print_draw_stats() {
+	printf("Drawing: %u quads, %u texture switches, %u dropped, room for %u (%u increases)\n", this->draw_stats.quads,
+		this->draw_stats.texture_switches, this->draw_stats.dropped, object_budget, this->draw_stats.budget_increases);
+	printf("Culled: %u empty quads, %u hidden tiles\n", this->draw_stats.empty_quads, this->draw_stats.hidden_tiles);
+}
+
+// --------------------------------------------------------
+
 void TilemapTownClient::draw_map(int camera_x, int camera_y) {
 	if(!this->map_received)
 		return;
@@ -459,55 +725,100 @@ void TilemapTownClient::draw_map(int camera_x, int camera_y) {
 	int camera_offset_y = camera_y % 16;
 	int camera_tile_x = camera_x / 16;
 	int camera_tile_y = camera_y / 16;
-
-	for(int y=0; y<=VIEW_HEIGHT_TILES; y++) {
-		for(int x=0; x<=VIEW_WIDTH_TILES; x++) {
+	TileDrawList *draw_list = &this->draw_list;
+
+	// Only the part of the view that's on the map gets looked at, and each cell only once;
+	// "over" objects go into their own layer so they still end up on top of the entities
+	int start_x = std::max(0, -camera_tile_x), end_x = std::min(VIEW_WIDTH_TILES, this->town_map.width - 1 - camera_tile_x);
+	int start_y = std::max(0, -camera_tile_y), end_y = std::min(VIEW_HEIGHT_TILES, this->town_map.height - 1 - camera_tile_y);
+	for(int y=start_y; y<=end_y && start_x<=end_x; y++) {
+		int real_y = camera_tile_y + y;
+		float draw_y = y*16-camera_offset_y;
+		MapCell *cell = &this->town_map.cells[real_y * this->town_map.width + camera_tile_x + start_x];
+
+		for(int x=start_x; x<=end_x; x++, cell++) {
 			int real_x = camera_tile_x + x;
-			int real_y = camera_tile_y + y;
-			if(real_x < 0 || real_x >= this->town_map.width || real_y < 0 || real_y >= this->town_map.height)
-				continue;
-
-			int index = real_y * this->town_map.width + real_x;
 			float draw_x = x*16-camera_offset_x;
-			float draw_y = y*16-camera_offset_y;
+
+			// Find the topmost object that's solid all the way across, if any; "over" objects are above all the others
+			int cover = -1;
+			bool cover_over = false;
+			for(size_t i=0; i<cell->objs.size(); i++) {
+				MapTileInfo *obj = cell->objs[i].get(this);
+				if(!obj || (cover_over && !obj->over))
+					continue;
+				if(atom_covers_cell(this, obj, tenth_of_second_counter)) {
+					cover = i;
+					cover_over = obj->over;
+				}
+			}
 
 			// Draw turf
-			MapTileInfo *turf = this->town_map.cells[index].turf.get(this);
+			MapTileInfo *turf = cell->turf.get(this);
 			if(turf) {
-				draw_atom_with_autotile(this, turf, real_x, real_y, draw_x, draw_y, false, tenth_of_second_counter);
+				if(cover >= 0) {
+					draw_list->hidden_tiles++;
+				} else {
+					draw_list->layer = DRAW_LAYER_TURF;
+					draw_list->depth = 0;
+					draw_atom_with_autotile(this, turf, real_x, real_y, draw_x, draw_y, false, tenth_of_second_counter);
+				}
 			}
 
-			// Draw objects
-			for(auto & element : this->town_map.cells[index].objs) {
-				MapTileInfo *obj = element.get(this);
-				if(!obj || obj->over)
+			// Draw objects, skipping the ones that would end up underneath the cover
+			draw_list->depth = 0;
+			for(size_t i=0; i<cell->objs.size(); i++) {
+				MapTileInfo *obj = cell->objs[i].get(this);
+				if(!obj)
+					continue;
+				bool hidden = cover >= 0 && ((int)i < cover ? (obj->over <= cover_over) : (!obj->over && cover_over));
+				if(hidden) {
+					draw_list->hidden_tiles++;
 					continue;
+				}
+				draw_list->layer = obj->over ? DRAW_LAYER_OVER : DRAW_LAYER_OBJS;
 				draw_atom_with_autotile(this, obj, real_x, real_y, draw_x, draw_y, true, tenth_of_second_counter);
+				draw_list->depth++;
 			}
 		}
 	}
 
-	// Draw entities
+	// Draw entities; the grid hands back the ones near the camera, already sorted by y
+	int cull_x1 = camera_tile_x - 3, cull_y1 = camera_tile_y - 3;
+	int cull_x2 = camera_tile_x + VIEW_WIDTH_TILES + 3, cull_y2 = camera_tile_y + VIEW_HEIGHT_TILES + 3;
+	std::vector<Entity*> &sorted_entities = this->entity_draw_list;
+	this->entity_grid.query(cull_x1, cull_y1, cull_x2, cull_y2, sorted_entities);
 
-	std::vector<Entity*> sorted_entities;
-	for(auto& [key, entity] : this->who) {
-		sorted_entities.push_back(&entity);
-	}
-	std::sort(sorted_entities.begin(), sorted_entities.end(), sort_entity_by_y_pos);
+	// Other entities are drawn a little in the past so their movement can be smoothed out
+	Entity *you = this->your_entity();
+	uint64_t now = get_time_us();
+	uint64_t render_time = now - this->interpolation.delay_us;
 
+	draw_list->layer = DRAW_LAYER_ENTITIES;
+	draw_list->depth = 0;
 	for(auto& entity : sorted_entities) {
-		if(entity->walk_timer)
-			entity->walk_timer--;
+		// Grid cells are bigger than a tile, so some of these are still off screen
 		if(
-			(entity->x < (camera_tile_x - 3)) ||
-			(entity->y < (camera_tile_y - 3)) ||
-			(entity->x > (camera_tile_x + VIEW_WIDTH_TILES + 3)) ||
-			(entity->y > (camera_tile_y + VIEW_HEIGHT_TILES + 3))
+			(entity->x < cull_x1) ||
+			(entity->y < cull_y1) ||
+			(entity->x > cull_x2) ||
+			(entity->y > cull_y2)
 		)
 			continue;
 
+		float entity_x, entity_y;
+		if(entity == you) {
+			entity_x = entity->x * 16;
+			entity_y = entity->y * 16;
+		} else {
+			entity->get_draw_position(render_time, &entity_x, &entity_y);
+		}
+		entity_x = roundf(entity_x) + entity->offset_x - camera_x;
+		entity_y = roundf(entity_y) + entity->offset_y - camera_y;
+
 		const C2D_Image *image = entity->pic.get(this);
 		if(image) {
+			draw_list->depth++;
 			int tileset_width  = entity->pic.extra_info->original_width;
 			int tileset_height = entity->pic.extra_info->original_height;
 			//bool player_is_16x16 = false;
@@ -515,12 +826,12 @@ void TilemapTownClient::draw_map(int camera_x, int camera_y) {
 			if(tileset_width == 16 && tileset_height == 16) {
 				//player_is_16x16 = true;
 
-				Tex3DS_SubTexture subtexture = calc_subtexture(image->tex->width, image->tex->height, 16, 16, 0, 0);
-				C2D_Image new_image = {image->tex, &subtexture};
-				C2D_DrawImageAt(new_image, (entity->x*16)-camera_x+entity->offset_x, (entity->y*16)-camera_y+entity->offset_y, 0, NULL, 1.0f, -1.0f);
+				C2D_Image new_image = {image->tex, entity->pic.subtextures->tile(0, 0)};
+				if(new_image.subtex)
+					draw_list->add(new_image, entity_x, entity_y);
 			} else if(string_is_http_url(entity->pic.key)) {
 				int frame_x = 0, frame_y = 0;
-				bool is_walking = entity->walk_timer != 0;
+				bool is_walking = entity->walk_until > now;
 
 				switch(tileset_height / 32) { // Directions
 					case 2: frame_y = entity->direction_lr / 4; break;
@@ -534,34 +845,16 @@ void TilemapTownClient::draw_map(int camera_x, int camera_y) {
 					case 8: frame_x = (is_walking * 4) + ((tenth_of_second_counter/2) & 3); break;
 				}
 
-				Tex3DS_SubTexture subtexture = calc_subtexture(image->tex->width, image->tex->height, 32, 32, frame_x, frame_y);
-				C2D_Image new_image = {image->tex, &subtexture};
-				C2D_DrawImageAt(new_image, (entity->x*16-8)-camera_x+entity->offset_x, (entity->y*16-16)-camera_y+entity->offset_y, 0, NULL, 1.0f, -1.0f);
+				C2D_Image new_image = {image->tex, entity->pic.subtextures->frame(frame_x, frame_y)};
+				if(new_image.subtex)
+					draw_list->add(new_image, entity_x-8, entity_y-16);
 			} else {
-				C2D_DrawImageAt(*image, (entity->x*16)-camera_x+entity->offset_x, (entity->y*16)-camera_y+entity->offset_y, 0, NULL, 1.0f, -1.0f);
+				draw_list->add(*image, entity_x, entity_y);
 			}
 
 		}
 	}
 
-	// Display "over" objects (Could be reworked to avoid scanning over the map a second time, but it's probably fine)
-	for(int y=0; y<=VIEW_HEIGHT_TILES; y++) {
-		for(int x=0; x<=VIEW_WIDTH_TILES; x++) {
-			int real_x = camera_tile_x + x;
-			int real_y = camera_tile_y + y;
-			if(real_x < 0 || real_x >= this->town_map.width || real_y < 0 || real_y >= this->town_map.height)
-				continue;
-
-			int index = real_y * this->town_map.width + real_x;
-
-			// Draw objects
-			for(auto & element : this->town_map.cells[index].objs) {
-				MapTileInfo *obj = element.get(this);
-				if(!obj || !obj->over)
-					continue;
-				draw_atom_with_autotile(this, obj, real_x, real_y, x*16-camera_offset_x, y*16-camera_offset_y, true, tenth_of_second_counter);
-			}
-		}
-	}
+	// Everything's been collected, so now it can go out one layer at a time, grouped by texture
+	draw_list->draw(&this->draw_stats);
 }
-
@@ -22,10 +22,15 @@ int network_init();
 void network_finish();
 void http_png_callback(const char *url, uint8_t *memory, size_t size, TilemapTownClient *client, void *userdata);
 
+void run_benchmarks();
+
 bool main_menu();
 void show_keyboard(TilemapTownClient *client);
 const char *prompt_for_text(const char *hint, const char *initial);
 
+extern unsigned int object_budget;
+void fit_object_budget(DrawStats *stats);
+
 extern int texture_loaded_yet;
 extern C3D_Tex loaded_texture;
 
@@ -33,6 +38,7 @@ extern C3D_Tex loaded_texture;
 extern char login_hostname[256];
 extern char login_path[256];
 extern char login_port[6];
+extern char capture_filename[256];
 
 void wait_for_key() {
 	// Just wait for keys and then exit
@@ -51,7 +57,7 @@ int main(int argc, char* argv[]) {
 	TilemapTownClient client = TilemapTownClient();
 	gfxInitDefault();
 	C3D_Init(C3D_DEFAULT_CMDBUF_SIZE);
-	C2D_Init(C2D_DEFAULT_MAX_OBJECTS);
+	C2D_Init(object_budget);
 	C2D_Prepare();
 	consoleInit(GFX_BOTTOM, NULL);
 	hidSetRepeatParameters(20, 10);
@@ -76,6 +82,8 @@ int main(int argc, char* argv[]) {
 			continue;
 		}
 		puts("Connected! Press X to chat.");
+		if(*capture_filename)
+			client.start_capture(capture_filename);
 
 		// --------------------------------------------------------------
 
@@ -92,13 +100,28 @@ int main(int argc, char* argv[]) {
 			u32 kDownRepeat = hidKeysDownRepeat();
 			if(kDown & KEY_B) {
 				printf("How many tiles: %d %d\n", client.tileset.size(), client.json_tileset.size());
+				client.print_network_stats();
+				client.print_draw_stats();
 			}
 			if(kDown & KEY_X) {
 				show_keyboard(&client);
 			}
+			if(kDown & KEY_SELECT) {
+				run_benchmarks();
+			}
 
 			client.walk_through_walls = (kHeld & KEY_Y); // Temporary
 
+			// Tapping the bottom screen walks to that spot, taking the bottom screen as being under the middle of the top one
+			if(kDown & KEY_TOUCH) {
+				touchPosition touch;
+				hidTouchRead(&touch);
+				client.walk_to((round(client.camera_x) + 40 + touch.px) / 16, (round(client.camera_y) + touch.py) / 16);
+			}
+			if(kDownRepeat & (KEY_LEFT | KEY_DOWN | KEY_UP | KEY_RIGHT))
+				client.cancel_walk();
+			client.update_walk();
+
 			if(kDownRepeat & KEY_LEFT)  client.move_player(-1,  0);
 			if(kDownRepeat & KEY_DOWN)  client.move_player( 0,  1);
 			if(kDownRepeat & KEY_UP)    client.move_player( 0, -1);
@@ -116,6 +139,7 @@ int main(int argc, char* argv[]) {
 
 			// Render the scene
 			C3D_FrameBegin(C3D_FRAME_SYNCDRAW); // vsync
+			fit_object_budget(&client.draw_stats); // Last frame's stats; the GPU is done with it now
 			C2D_TargetClear(top, C2D_Color32(0, 0, 0, 255));
 			C2D_SceneBegin(top);
 			client.update_camera(0, 0);
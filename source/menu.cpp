@@ -35,6 +35,9 @@ char login_hostname[256] = "novasquirrel.com";
 char login_path[256]     = "/townws/";
 char login_port[6]       = "443";
 
+// Debugging
+char capture_filename[256] = ""; // Record everything the server sends, for replay_capture
+
 // ----------------------------------------------
 
 enum config_types {
@@ -55,6 +58,7 @@ struct config_item {
 	{"Server", "Hostname", &login_hostname, CONFIG_STRING, sizeof(login_hostname), false},
 	{"Server", "Path",     &login_path, CONFIG_STRING, sizeof(login_path), false},
 	{"Server", "Port",     &login_port, CONFIG_STRING, sizeof(login_port), false},
+	{"Debug", "Capture",   &capture_filename, CONFIG_STRING, sizeof(capture_filename), true},
 	{NULL}
 };
 
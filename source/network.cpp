@@ -19,6 +19,7 @@
 #include "town.hpp"
 #include "cJSON.h"
 #include <stdlib.h>
+#include <algorithm>
 
 #ifdef __3DS__
 #include <3ds.h>
@@ -55,21 +56,37 @@ struct wslay_event_callbacks wslay_callbacks = {
 	wslay_message,
 };
 
+#ifdef __3DS__
 static u32 *SOC_buffer = NULL;
+#endif
 
 // Login details
 extern char login_username[256];
 extern char login_password[256];
 extern bool guest_login;
 
+// ----------------------------------------------
+// - Timing
+// ----------------------------------------------
+
+uint64_t get_time_us() {
+	#ifdef __3DS__
+	return (uint64_t)(svcGetSystemTick() / CPU_TICKS_PER_USEC);
+	#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	#endif
+}
+
 // ----------------------------------------------
 // - Initialization
 // ----------------------------------------------
 
 int network_init() {
+	#ifdef __3DS__
 	int ret;
 
-	#ifdef __3DS__
 	// allocate buffer for SOC service
 	SOC_buffer = (u32*)memalign(SOC_ALIGN, SOC_BUFFERSIZE);
 
@@ -111,6 +128,19 @@ static void my_debug(void *ctx, int level,
     fflush((FILE *) ctx);
 }
 
+// Reads and writes go through TLS, unless it's a plain websocket connection
+static int connection_read(TilemapTownClient *client, unsigned char *buf, size_t len) {
+	if(client->plain_websocket)
+		return mbedtls_net_recv(&client->server_fd, buf, len);
+	return mbedtls_ssl_read(&client->ssl, buf, len);
+}
+
+static int connection_write(TilemapTownClient *client, const unsigned char *buf, size_t len) {
+	if(client->plain_websocket)
+		return mbedtls_net_send(&client->server_fd, buf, len);
+	return mbedtls_ssl_write(&client->ssl, buf, len);
+}
+
 int TilemapTownClient::network_connect(std::string host, std::string path, std::string port) {
 	// Based on "SSL client demonstration program"
 	// available under the Apache 2.0 license
@@ -153,6 +183,10 @@ int TilemapTownClient::network_connect(std::string host, std::string path, std::
 		goto fail;
 	}
 
+	// Local test servers can skip TLS entirely
+	if(this->plain_websocket)
+		goto handshake_done;
+
 	// Setup
 	//puts("mbedtls_ssl_config_defaults");
 	if(mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
@@ -189,12 +223,13 @@ int TilemapTownClient::network_connect(std::string host, std::string path, std::
 
 	// -----------------------------------------------------------------------
 
+handshake_done:
 	len = connect_string.length();
 
 	//puts("mbedtls_ssl_write");
 
 	// Write
-    while((ret = mbedtls_ssl_write(&this->ssl, (const unsigned char*)connect_string.c_str(), len)) <= 0) {
+    while((ret = connection_write(this, (const unsigned char*)connect_string.c_str(), len)) <= 0) {
         if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
 			puts("mbedtls_ssl_write failed");
             goto fail;
@@ -208,7 +243,7 @@ int TilemapTownClient::network_connect(std::string host, std::string path, std::
     do {
         memset(buf, 0, sizeof(buf));
 
-        ret = mbedtls_ssl_read(&this->ssl, buf, sizeof(buf)-len-1);
+        ret = connection_read(this, buf, sizeof(buf)-len-1);
         if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
             continue;
         } else if(ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
@@ -252,6 +287,17 @@ int TilemapTownClient::network_connect(std::string host, std::string path, std::
 	// Other initialization
 	this->http.client = this;
 	this->connected = true;
+	this->pending_move = PendingMove();
+	this->pending_image_requests.clear();
+	this->requested_tile_sheets.clear();
+	this->map_tile_sheets_waiting.clear();
+	this->map_tile_sheets_abandoned.clear();
+	this->reset_outbound();
+	this->server_supports_batch = false;
+	if(!this->outbound_byte_budget)
+		this->outbound_byte_budget = OUTBOUND_BYTES_PER_TICK;
+	this->predicted_moves.clear();
+	this->ping_sent_at = 0;
 
 	{
 	// Kick off the connection by sending a IDN message!
@@ -294,7 +340,8 @@ fail:
 
 void TilemapTownClient::network_disconnect() {
 	if(this->connected) {
-		mbedtls_ssl_close_notify(&this->ssl);
+		if(!this->plain_websocket)
+			mbedtls_ssl_close_notify(&this->ssl);
 
 		mbedtls_net_free(&this->server_fd);
 		mbedtls_x509_crt_free(&this->cacert);
@@ -305,11 +352,26 @@ void TilemapTownClient::network_disconnect() {
 
 		this->connected = false;
 	}
+	this->stop_capture();
 }
 
 void TilemapTownClient::network_update() {
 	if(this->connected)
 		wslay_event_recv(this->websocket);
+	if(this->connected) {
+		this->flush_image_requests();
+		// Keep merging movement while the last MOV is still waiting to go out
+		if(this->outbound_lanes[LANE_MOVEMENT].messages.empty())
+			this->flush_pending_move();
+		// Only hand more to wslay once it's caught up, so that the lanes decide what goes first
+		if(this->in_flight_bytes < this->outbound_byte_budget)
+			this->flush_outbound();
+
+		size_t queue_depth = wslay_event_get_queued_msg_count(this->websocket);
+		this->outbound_stats.queue_depth = queue_depth;
+		if(queue_depth > this->outbound_stats.max_queue_depth)
+			this->outbound_stats.max_queue_depth = queue_depth;
+	}
 	if(this->connected && wslay_event_want_write(this->websocket))
         wslay_event_send(this->websocket);
 	this->http.run_transfers();
@@ -442,11 +504,15 @@ ssize_t wslay_recv(wslay_event_context_ptr ctx, uint8_t *data, size_t len, int f
 
 	if(!client->connected)
 		return WSLAY_ERR_WOULDBLOCK;
-	int ret = mbedtls_ssl_read(&client->ssl, data, len);
+	int ret = connection_read(client, data, len);
 	if(ret <= 0) {
 		if(ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_WRITE && ret != MBEDTLS_ERR_SSL_WANT_READ) {
 			client->connected = false;
 			printf("Received recv error code %d\n", ret);
+		} else if(ret == 0 && client->plain_websocket) {
+			// Without TLS there's no close notify, the socket just reaches EOF
+			client->connected = false;
+			puts("Server closed the connection");
 		}
 		return WSLAY_ERR_WOULDBLOCK;
 	}
@@ -458,7 +524,7 @@ ssize_t wslay_send(wslay_event_context_ptr ctx, const uint8_t *data, size_t len,
 
 	if(!client->connected)
 		return WSLAY_ERR_WOULDBLOCK;
-	int ret = mbedtls_ssl_write(&client->ssl, data, len);
+	int ret = connection_write(client, data, len);
 	if(ret <= 0) {
 		if(ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_WRITE && ret != MBEDTLS_ERR_SSL_WANT_READ) {
 			client->connected = false;
@@ -478,6 +544,8 @@ int wslay_genmask(wslay_event_context_ptr ctx, uint8_t *buf, size_t len, void *u
 void wslay_message(wslay_event_context_ptr ctx, const struct wslay_event_on_msg_recv_arg *arg, void *user_data) {
 	TilemapTownClient *client = (TilemapTownClient*)user_data;
 	if(arg->opcode == WSLAY_TEXT_FRAME) {
+		if(client->capture_file)
+			client->capture_message((const char*)arg->msg, arg->msg_length);
 		client->websocket_message((const char*)arg->msg, arg->msg_length);
 	} else if(arg->opcode == WSLAY_CONNECTION_CLOSE) {
 		puts("\x1b[31mConnection closed\x1b[0m\nPress A to continue");
@@ -486,10 +554,358 @@ void wslay_message(wslay_event_context_ptr ctx, const struct wslay_event_on_msg_
 	}
 }
 
+static enum OutboundLane lane_for_command(const char *text, size_t length) {
+	if(length < 3)
+		return LANE_INTERACTION;
+	switch(protocol_command_as_int(text[0], text[1], text[2])) {
+		case protocol_command_as_int('M', 'O', 'V'):
+			return LANE_MOVEMENT;
+		case protocol_command_as_int('M', 'S', 'G'):
+		case protocol_command_as_int('C', 'M', 'D'):
+			return LANE_CHAT;
+		case protocol_command_as_int('I', 'M', 'G'):
+			return LANE_ASSETS;
+	}
+	return LANE_INTERACTION;
+}
+
+// ----------------------------------------------
+// - Outbound buffers
+// ----------------------------------------------
+
+// Messages are serialized straight into the end of their lane's buffer, and wslay reads the
+// frames back out of that same buffer through a fragmented message callback, so the bytes
+// aren't copied again until wslay masks them into its output buffer. Lane buffers keep their
+// capacity between messages, so a connection stops allocating once they've grown enough.
+
+char *TilemapTownClient::begin_outbound_message(enum OutboundLane lane, size_t max_length) {
+	OutboundLaneQueue *queue = &this->outbound_lanes[lane];
+	queue->write_start = queue->buffer.size();
+	queue->buffer.resize(queue->write_start + max_length);
+	return queue->buffer.data() + queue->write_start;
+}
+
+void TilemapTownClient::end_outbound_message(enum OutboundLane lane, size_t length) {
+	// Trim the unused space and record where the message is; a length of zero cancels it
+	OutboundLaneQueue *queue = &this->outbound_lanes[lane];
+	size_t start = queue->write_start;
+	queue->buffer.resize(start + length);
+	if(!length)
+		return;
+	queue->buffer.push_back('\n');
+
+	OutboundMessage message;
+	message.position = start + queue->erased;
+	message.length = length;
+	message.queued_at = get_time_us();
+	queue->messages.push_back(message);
+}
+
+void TilemapTownClient::websocket_write(const char *text, size_t length) {
+	// Messages wait in a lane until the next network tick, see flush_outbound()
+	enum OutboundLane lane = lane_for_command(text, length);
+	memcpy(this->begin_outbound_message(lane, length), text, length);
+	this->end_outbound_message(lane, length);
+}
+
 void TilemapTownClient::websocket_write(std::string text) {
-	struct wslay_event_msg event_message;
+	this->websocket_write(text.c_str(), text.size());
+}
+
+void TilemapTownClient::websocket_write(std::string command, cJSON *json) {
+	if(json == NULL) {
+		this->websocket_write(command);
+		return;
+	}
+	enum OutboundLane lane = lane_for_command(command.c_str(), command.size());
+	size_t prefix = command.size() + 1;
+	size_t room = this->json_size_hint ? this->json_size_hint : 256;
+
+	// Print the JSON right after the command, growing the space if it didn't fit
+	while(1) {
+		char *buffer = this->begin_outbound_message(lane, prefix + room);
+		memcpy(buffer, command.c_str(), command.size());
+		buffer[command.size()] = ' ';
+		if(cJSON_PrintPreallocated(json, buffer + prefix, room, false)) {
+			this->end_outbound_message(lane, prefix + strlen(buffer + prefix));
+			return;
+		}
+		this->end_outbound_message(lane, 0);
+
+		if(room >= 0x100000) {
+			puts("Outgoing message is too big");
+			return;
+		}
+		room *= 2;
+		if(room <= 4096 && room > this->json_size_hint)
+			this->json_size_hint = room;
+	}
+}
+
+void TilemapTownClient::reset_outbound() {
+	for(int lane=0; lane<LANE_COUNT; lane++) {
+		OutboundLaneQueue *queue = &this->outbound_lanes[lane];
+		queue->buffer.clear();
+		queue->messages.clear();
+		queue->erased = 0;
+		queue->sent = 0;
+		queue->frames_in_flight = 0;
+	}
+	this->frames_in_flight.clear();
+	this->in_flight_bytes = 0;
+}
+
+static ssize_t outbound_frame_read(wslay_event_context_ptr ctx, uint8_t *buf, size_t len, const union wslay_event_msg_source *source, int *eof, void *user_data) {
+	TilemapTownClient *client = (TilemapTownClient*)user_data;
+	OutboundFrame *frame = (OutboundFrame*)source->data;
+	OutboundLaneQueue *queue = &client->outbound_lanes[frame->lane];
+	size_t prefix = frame->batch ? 4 : 0;
+	size_t total = prefix + frame->length;
+	size_t out = 0;
+
+	while(out < len && frame->read < total) {
+		if(frame->read < prefix) {
+			buf[out++] = "BAT "[frame->read++];
+			continue;
+		}
+		size_t offset = frame->read - prefix;
+		size_t amount = std::min(len - out, frame->length - offset);
+		memcpy(buf + out, queue->buffer.data() + (frame->position - queue->erased) + offset, amount);
+		out += amount;
+		frame->read += amount;
+	}
+	client->in_flight_bytes -= out;
+
+	if(frame->read == total) {
+		// wslay sends messages in the order they were queued, so this is always the oldest frame
+		*eof = 1;
+		queue->frames_in_flight--;
+		client->frames_in_flight.pop_front();
+	}
+	return out;
+}
+
+static void websocket_send_frame(TilemapTownClient *client, int lane, size_t position, size_t length, bool batch) {
+	client->frames_in_flight.push_back({lane, position, length, 0, batch});
+	client->outbound_lanes[lane].frames_in_flight++;
+	client->in_flight_bytes += length + (batch ? 4 : 0);
+
+	struct wslay_event_fragmented_msg event_message;
 	event_message.opcode = WSLAY_TEXT_FRAME;
-	event_message.msg = (const uint8_t*)text.c_str();
-	event_message.msg_length = text.size();
-	wslay_event_queue_msg(this->websocket, &event_message);
+	event_message.source.data = &client->frames_in_flight.back(); // deque::push_back keeps this pointer valid
+	event_message.read_callback = outbound_frame_read;
+	wslay_event_queue_fragmented_msg(client->websocket, &event_message);
+}
+
+// ----------------------------------------------
+// - Outbound scheduling
+// ----------------------------------------------
+
+// Lanes are drained in priority order, so movement never waits behind a long chat message
+// or a pile of asset requests. Messages from the same lane get packed into one BAT frame if
+// the server supports it. Each tick gets a byte budget, and anything that doesn't fit stays
+// queued for the next tick; the first message of a tick is always allowed through so that
+// a message bigger than the budget can't get stuck forever.
+
+void TilemapTownClient::flush_outbound() {
+	size_t budget = this->outbound_byte_budget;
+	size_t spent = 0;
+	uint64_t now = get_time_us();
+
+	for(int lane=0; lane<LANE_COUNT; lane++) {
+		OutboundLaneQueue *queue = &this->outbound_lanes[lane];
+		OutboundLaneStats *stats = &this->outbound_stats.lanes[lane];
+
+		// Drop whatever wslay is done reading
+		if(!queue->frames_in_flight && queue->sent > queue->erased) {
+			queue->buffer.erase(0, queue->sent - queue->erased);
+			queue->erased = queue->sent;
+		}
+
+		while(!queue->messages.empty()) {
+			size_t length = queue->messages.front().length;
+			if(spent && spent + length > budget) {
+				this->outbound_stats.ticks_over_budget++;
+				return;
+			}
+
+			// Take as many messages as will fit; they're already newline separated in the buffer
+			size_t count = 1;
+			size_t frame_length = length;
+			bool batch = false;
+			if(this->server_supports_batch) {
+				while(count < queue->messages.size()) {
+					size_t next_length = queue->messages[count].length + 1;
+					if(spent + 4 + frame_length + next_length > budget)
+						break;
+					frame_length += next_length;
+					count++;
+				}
+				batch = count > 1;
+			}
+
+			size_t position = queue->messages.front().position;
+			websocket_send_frame(this, lane, position, frame_length, batch);
+			queue->sent = position + frame_length + 1;
+
+			// Record how long each message waited
+			for(size_t i=0; i<count; i++) {
+				uint64_t latency = now - queue->messages.front().queued_at;
+				stats->total_latency_us += latency;
+				if(latency > stats->max_latency_us)
+					stats->max_latency_us = latency;
+				queue->messages.pop_front();
+			}
+			if(batch)
+				frame_length += 4;
+			stats->messages += count;
+			stats->frames++;
+			stats->bytes += frame_length;
+			spent += frame_length;
+		}
+	}
+}
+
+// ----------------------------------------------
+// - Outbound MOV coalescing
+// ----------------------------------------------
+
+// Only one MOV is held at a time, and the newest state wins. Steps get merged together,
+// and turns get merged into whatever is pending. Bumps are never merged away though,
+// because the server needs to see each one happen in order.
+
+int PendingMove::format(char *buffer, size_t size) {
+	if(this->has_move) {
+		return snprintf(buffer, size, "MOV {\"from\":[%d,%d],\"to\":[%d,%d],\"dir\":%d}", this->from_x, this->from_y, this->to_x, this->to_y, this->direction);
+	} else if(this->has_bump) {
+		// Tell server what map the bump is intended for
+		if(this->bump_map != 0)
+			return snprintf(buffer, size, "MOV {\"bump\":[%d,%d],\"if_map\":%d,\"dir\":%d}", this->bump_x, this->bump_y, this->bump_map, this->direction);
+		return snprintf(buffer, size, "MOV {\"bump\":[%d,%d],\"dir\":%d}", this->bump_x, this->bump_y, this->direction);
+	}
+	return snprintf(buffer, size, "MOV {\"dir\":%d}", this->direction);
+}
+
+static void discard_pending_move(TilemapTownClient *client) {
+	// The pending MOV is about to be replaced by a newer one, so count what got saved
+	char buffer[128];
+	int length = client->pending_move.format(buffer, sizeof(buffer));
+	client->outbound_stats.mov_coalesced++;
+	if(length > 0)
+		client->outbound_stats.mov_bytes_saved += length;
+}
+
+void TilemapTownClient::queue_turn(int direction) {
+	if(this->pending_move.active) {
+		discard_pending_move(this);
+		this->pending_move.direction = direction;
+		return;
+	}
+	this->pending_move = PendingMove();
+	this->pending_move.active = true;
+	this->pending_move.direction = direction;
+}
+
+void TilemapTownClient::queue_step(int from_x, int from_y, int to_x, int to_y, int direction) {
+	PendingMove *pending = &this->pending_move;
+
+	if(pending->active) {
+		if(pending->has_move && pending->to_x == from_x && pending->to_y == from_y) {
+			// Continue on from where the pending move ends
+			discard_pending_move(this);
+			pending->to_x = to_x;
+			pending->to_y = to_y;
+			pending->direction = direction;
+			return;
+		} else if(!pending->has_move && !pending->has_bump) {
+			// A turn is made redundant by the step's direction
+			discard_pending_move(this);
+		} else {
+			this->flush_pending_move();
+		}
+	}
+
+	*pending = PendingMove();
+	pending->active = true;
+	pending->has_move = true;
+	pending->from_x = from_x;
+	pending->from_y = from_y;
+	pending->to_x = to_x;
+	pending->to_y = to_y;
+	pending->direction = direction;
+}
+
+void TilemapTownClient::queue_bump(int bump_x, int bump_y, int direction) {
+	PendingMove *pending = &this->pending_move;
+
+	if(pending->active) {
+		if(!pending->has_move && !pending->has_bump) {
+			discard_pending_move(this);
+		} else {
+			// Anything that actually moved or bumped has to get to the server first
+			this->flush_pending_move();
+		}
+	}
+
+	*pending = PendingMove();
+	pending->active = true;
+	pending->has_bump = true;
+	pending->bump_x = bump_x;
+	pending->bump_y = bump_y;
+	pending->bump_map = this->town_map.id;
+	pending->direction = direction;
+}
+
+void TilemapTownClient::flush_pending_move() {
+	if(!this->pending_move.active)
+		return;
+	this->pending_move.active = false;
+
+	// Written straight into the movement lane, without going through cJSON
+	char *buffer = this->begin_outbound_message(LANE_MOVEMENT, 128);
+	int length = this->pending_move.format(buffer, 128);
+	if(length <= 0 || length >= 128) {
+		this->end_outbound_message(LANE_MOVEMENT, 0);
+		return;
+	}
+	this->end_outbound_message(LANE_MOVEMENT, length);
+	this->outbound_stats.mov_sent++;
+	if(this->pending_move.has_move)
+		this->mark_predictions_sent();
+}
+
+// Sends a PIN of our own, and the reply's arrival gets timed
+void TilemapTownClient::send_ping() {
+	if(this->ping_sent_at)
+		return;
+	this->ping_sent_at = get_time_us();
+	this->websocket_write("PIN");
+}
+
+void TilemapTownClient::print_network_stats() {
+	OutboundStats *stats = &this->outbound_stats;
+	printf("MOV: %u sent, %u merged, %zu bytes saved\n", stats->mov_sent, stats->mov_coalesced, stats->mov_bytes_saved);
+	printf("Send queue: %zu now, %zu max\n", stats->queue_depth, stats->max_queue_depth);
+	printf("Ticks over budget: %u\n", stats->ticks_over_budget);
+	printf("MOV/WHO in: %u fast, %u through cJSON\n", this->inbound_stats.fast_path, this->inbound_stats.fallback);
+	printf("Interpolation: %lu ms behind, %.1f ms jitter, %u steps, %u jumps\n", (unsigned long)(this->interpolation.delay_us / 1000), this->interpolation.jitter_us / 1000, this->interpolation.steps, this->interpolation.teleports);
+	PredictionStats *prediction = &this->prediction_stats;
+	printf("Prediction: %u confirmed, %u corrected, %u replayed, %zu waiting\n", prediction->confirmed, prediction->corrected, prediction->replayed, this->predicted_moves.size());
+	printf("Tiles: %zu defined, %zu custom, %zu not defined yet\n", this->tileset.size(), this->json_tileset.size(), this->pending_tiles.size());
+	CustomTileStats *custom = &this->json_tileset.stats;
+	if(custom->created)
+		printf("Custom tiles: %u uses of %u tiles (%.1fx), %zu KB saved, %u swept\n", custom->references, custom->created,
+			(double)custom->references / custom->created, custom->bytes_saved / 1024, custom->swept);
+	if(!this->waiting_for_tile_sheets && this->map_received)
+		printf("%u tile sheets needed, resolved in %llu ms, %zu given up on\n", this->tile_sheets_requested,
+			(unsigned long long)(this->tile_sheets_resolved_us / 1000), this->map_tile_sheets_abandoned.size());
+
+	const char *lane_names[] = {"move", "use", "chat", "asset"};
+	for(int lane=0; lane<LANE_COUNT; lane++) {
+		OutboundLaneStats *lane_stats = &stats->lanes[lane];
+		if(!lane_stats->messages)
+			continue;
+		printf("%-5s %u msg %u frames, wait avg %llu max %llu ms\n", lane_names[lane], lane_stats->messages, lane_stats->frames,
+			(unsigned long long)(lane_stats->total_latency_us / lane_stats->messages / 1000), (unsigned long long)(lane_stats->max_latency_us / 1000));
+	}
 }
@@ -0,0 +1,172 @@
+/*
+ * Tilemap Town client for 3DS
+ *
+ * Copyright (C) 2024 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "town.hpp"
+#include <algorithm>
+
+// Paths only use the four directions the D-pad does
+static const int direction_x[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+static const int direction_y[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+
+// .-------------------------------------------------------
+// | Search
+// '-------------------------------------------------------
+
+static bool node_is_worse(const PathNode &a, const PathNode &b) {
+	// Ties go to whichever is further along, which cuts down on how many cells get looked at
+	if(a.estimate != b.estimate)
+		return a.estimate > b.estimate;
+	return a.cost < b.cost;
+}
+
+// Fills directions with the steps to take from (from_x, from_y), checking walls the same way try_step does.
+// If (to_x, to_y) can't be reached, or the search gives up, the path goes to the closest place that was found
+// and false is returned.
+bool PathFinder::find(const TownMap *map, int from_x, int from_y, int to_x, int to_y, std::vector<uint8_t> &directions) {
+	directions.clear();
+	this->expanded = 0;
+	int width = map->width, height = map->height;
+	if(from_x < 0 || from_y < 0 || from_x >= width || from_y >= height)
+		return false;
+	to_x = std::clamp(to_x, 0, width - 1);
+	to_y = std::clamp(to_y, 0, height - 1);
+
+	size_t cell_count = width * height;
+	if(this->visited.size() != cell_count) {
+		this->cost.assign(cell_count, 0);
+		this->visited.assign(cell_count, 0);
+		this->came_from.assign(cell_count, 0);
+		this->search = 0;
+	}
+	// Bumping the search number marks every cell as unvisited
+	if(++this->search == 0) {
+		std::fill(this->visited.begin(), this->visited.end(), 0);
+		this->search = 1;
+	}
+
+	uint32_t start = from_y * width + from_x;
+	uint32_t goal = to_y * width + to_x;
+	auto distance = [&](uint32_t index) {
+		return (uint32_t)(abs((int)(index % width) - to_x) + abs((int)(index / width) - to_y));
+	};
+
+	this->open.clear();
+	this->visited[start] = this->search;
+	this->cost[start] = 0;
+	this->open.push_back({distance(start), 0, start});
+	uint32_t closest = start;
+	uint32_t closest_distance = distance(start);
+
+	while(!this->open.empty()) {
+		std::pop_heap(this->open.begin(), this->open.end(), node_is_worse);
+		PathNode node = this->open.back();
+		this->open.pop_back();
+		if(node.cost != this->cost[node.index]) // A shorter way here was found after this was added
+			continue;
+		this->expanded++;
+
+		uint32_t left = node.estimate - node.cost;
+		if(left < closest_distance) {
+			closest = node.index;
+			closest_distance = left;
+		}
+		if(node.index == goal || this->expanded >= PATH_SEARCH_LIMIT)
+			break;
+
+		int x = node.index % width;
+		int y = node.index / width;
+		uint8_t walls = map->collision[node.index].walls;
+		for(int direction=0; direction<8; direction+=2) {
+			if(walls & (1 << direction))
+				continue;
+			int next_x = x + direction_x[direction];
+			int next_y = y + direction_y[direction];
+			if(next_x < 0 || next_y < 0 || next_x >= width || next_y >= height)
+				continue;
+			uint32_t next = next_y * width + next_x;
+			if(map->collision[next].walls & (1 << ((direction + 4) & 7)))
+				continue;
+			uint32_t next_cost = node.cost + 1;
+			if(this->visited[next] == this->search && this->cost[next] <= next_cost)
+				continue;
+			this->visited[next] = this->search;
+			this->cost[next] = next_cost;
+			this->came_from[next] = direction;
+			this->open.push_back({next_cost + distance(next), next_cost, next});
+			std::push_heap(this->open.begin(), this->open.end(), node_is_worse);
+		}
+	}
+
+	// Follow the steps backwards from the end
+	for(uint32_t index = closest; index != start;) {
+		int direction = this->came_from[index];
+		directions.push_back(direction);
+		index -= direction_y[direction] * width + direction_x[direction];
+	}
+	std::reverse(directions.begin(), directions.end());
+	return closest == goal;
+}
+
+// .-------------------------------------------------------
+// | Walking a path
+// '-------------------------------------------------------
+
+bool TilemapTownClient::walk_to(int x, int y) {
+	Entity *you = this->your_entity();
+	if(!you || this->town_map.collision.empty())
+		return false;
+	this->walk_target_x = x;
+	this->walk_target_y = y;
+	this->walk_expect_x = you->x;
+	this->walk_expect_y = you->y;
+	this->walk_path_stale = false;
+	this->walk_path_position = 0;
+	this->path_finder.find(&this->town_map, you->x, you->y, x, y, this->walk_path);
+	return !this->walk_path.empty();
+}
+
+// Takes the next step on the path once enough time has passed, and goes through move_player like the D-pad would
+void TilemapTownClient::update_walk() {
+	if(this->walk_path_position >= this->walk_path.size())
+		return;
+	uint64_t now = get_time_us();
+	if(now < this->next_walk_step_at)
+		return;
+	Entity *you = this->your_entity();
+	if(!you) {
+		this->cancel_walk();
+		return;
+	}
+
+	// Plan again if a BLK got in the way, or if the server put you somewhere else
+	if(this->walk_path_stale || you->x != this->walk_expect_x || you->y != this->walk_expect_y) {
+		if(!this->walk_to(this->walk_target_x, this->walk_target_y))
+			return;
+	}
+
+	int direction = this->walk_path[this->walk_path_position++];
+	this->walk_expect_x = you->x + direction_x[direction];
+	this->walk_expect_y = you->y + direction_y[direction];
+	this->move_player(direction_x[direction], direction_y[direction]);
+	this->next_walk_step_at = now + PATH_STEP_US;
+}
+
+void TilemapTownClient::cancel_walk() {
+	this->walk_path.clear();
+	this->walk_path_position = 0;
+}
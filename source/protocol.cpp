@@ -19,8 +19,7 @@
 #include "town.hpp"
 #include "cJSON.h"
 #include <stdarg.h>
-
-#define protocol_command_as_int(a,b,c) (a) | (b<<8) | (c<<16)
+#include <algorithm>
 
 #define get_json_item cJSON_GetObjectItemCaseSensitive
 
@@ -163,7 +162,7 @@ int unpack_json_int_array(cJSON *json, int count, int *ptr, ...) {
 	return success;
 }
 
-int pic_from_json(cJSON *json, struct Pic *out) {
+int pic_from_json(cJSON *json, std::string *sheet, int *x, int *y) {
 	if(cJSON_GetArraySize(json) != 3)
 		return 0;
 
@@ -172,16 +171,16 @@ int pic_from_json(cJSON *json, struct Pic *out) {
 	cJSON *i_y     = cJSON_GetArrayItem(json, 2);
 
 	if(cJSON_IsNumber(i_x) && cJSON_IsNumber(i_y)) {
-		out->x = i_x->valueint;
-		out->y = i_y->valueint;
+		*x = i_x->valueint;
+		*y = i_y->valueint;
 	} else {
 		return 0;
 	}
 
 	if(cJSON_IsNumber(i_sheet)) {
-		out->key = std::to_string(i_sheet->valueint);
+		*sheet = std::to_string(i_sheet->valueint);
 	} else if(cJSON_IsString(i_sheet)) {
-		out->key = std::string(i_sheet->valuestring);
+		*sheet = std::string(i_sheet->valuestring);
 	} else {
 		return 0;
 	}
@@ -189,7 +188,7 @@ int pic_from_json(cJSON *json, struct Pic *out) {
 	return 1;
 }
 
-int map_tile_from_json(cJSON *json, MapTileInfo *out) {
+int map_tile_from_json(cJSON *json, MapTileInfo *out, TilemapTownClient *client) {
 	cJSON *i_name    = get_json_item(json, "name");
 	cJSON *i_pic     = get_json_item(json, "pic");
 	cJSON *i_obj     = get_json_item(json, "obj");
@@ -205,12 +204,22 @@ int map_tile_from_json(cJSON *json, MapTileInfo *out) {
 	cJSON *i_anim_mode   = get_json_item(json, "anim_mode");
 	cJSON *i_anim_offset = get_json_item(json, "anim_offset");
 
-	if(!pic_from_json(i_pic, &out->pic)) {
+	out->meta = std::make_shared<MapTileMeta>();
+	MapTileMeta *meta = out->meta.get();
+
+	std::string sheet;
+	int pic_x, pic_y;
+	if(!pic_from_json(i_pic, &sheet, &pic_x, &pic_y)) {
 		return 0;
 	}
+	out->sheet = client->get_tile_sheet(sheet);
+	out->pic_x = pic_x;
+	out->pic_y = pic_y;
 
 	const char *s_name = cJSON_GetStringValue(i_name);
-	out->name    = std::string(s_name ? s_name : "");
+	meta->name   = std::string(s_name ? s_name : "");
+	if(!meta->name.empty())
+		out->autotile_name = town_crc32(meta->name.c_str(), meta->name.size());
 
 	out->obj     = cJSON_IsTrue(i_obj);
 	out->walls   = cJSON_IsTrue(i_density) ? 255 : 0;
@@ -222,8 +231,10 @@ int map_tile_from_json(cJSON *json, MapTileInfo *out) {
 		out->type = !strcmp(s_type, "sign") ? MAP_TILE_SIGN : MAP_TILE_NONE;
 
 	// Autotile information
-	if(cJSON_IsNumber(i_autotile_layout))
-		out->autotile_layout = i_autotile_layout->valueint;
+	if(cJSON_IsNumber(i_autotile_layout)) {
+		int layout = i_autotile_layout->valueint;
+		out->autotile_layout = (layout >= 0 && layout < AUTOTILE_LAYOUT_UNKNOWN) ? layout : AUTOTILE_LAYOUT_UNKNOWN;
+	}
 	const char *s_autotile_class = cJSON_GetStringValue(i_autotile_class);
 	if(s_autotile_class)
 		out->autotile_class = town_crc32(s_autotile_class, strlen(s_autotile_class));
@@ -239,12 +250,54 @@ int map_tile_from_json(cJSON *json, MapTileInfo *out) {
 	// Optional message field, for signs
 	const char *s_message = cJSON_GetStringValue(i_message);
 	if(s_message)
-		out->message = std::string(s_message);
+		meta->message = std::string(s_message);
 
 	return 1;
 }
 
-std::string Entity::apply_json(cJSON *json) {
+// .-------------------------------------------------------
+// | MOV and WHO decoding
+// '-------------------------------------------------------
+
+// Numeric IDs get turned into text so they can be looked up in the same way as string IDs
+static void id_from_int(int value, char *buffer, std::string_view *out) {
+	int length = snprintf(buffer, 12, "%d", value);
+	*out = std::string_view(buffer, length);
+}
+
+static void id_from_json(cJSON *json, char *buffer, std::string_view *out) {
+	if(cJSON_IsString(json))
+		*out = std::string_view(json->valuestring);
+	else
+		id_from_int(json->valueint, buffer, out);
+}
+
+static bool mov_update_from_json(cJSON *json, MovUpdate *out) {
+	*out = MovUpdate();
+	cJSON *i_to     = get_json_item(json, "to");
+	cJSON *i_from   = get_json_item(json, "from");
+	cJSON *i_dir    = get_json_item(json, "dir");
+	cJSON *i_id     = get_json_item(json, "id");
+	cJSON *i_offset = get_json_item(json, "offset");
+	if(!cJSON_IsString(i_id) && !cJSON_IsNumber(i_id))
+		return false;
+	id_from_json(i_id, out->id_buffer, &out->id);
+
+	out->has_from = i_from != NULL;
+	out->has_to = unpack_json_int_array(i_to, 2, &out->to_x, &out->to_y);
+	if(cJSON_IsNumber(i_dir)) {
+		out->has_dir = true;
+		out->dir = i_dir->valueint;
+	}
+	if(i_offset) {
+		out->has_offset = true;
+		out->offset_valid = unpack_json_int_array(i_offset, 2, &out->offset_x, &out->offset_y);
+	}
+	return true;
+}
+
+static void entity_update_from_json(cJSON *json, EntityUpdate *out) {
+	*out = EntityUpdate();
 	cJSON *i_name         = get_json_item(json, "name");
 	cJSON *i_pic          = get_json_item(json, "pic");
 	cJSON *i_x            = get_json_item(json, "x");
@@ -255,60 +308,643 @@ std::string Entity::apply_json(cJSON *json) {
 	cJSON *i_passengers   = get_json_item(json, "passengers");
 	cJSON *i_vehicle      = get_json_item(json, "vehicle");
 	cJSON *i_is_following = get_json_item(json, "is_following");
-	cJSON *i_type         = get_json_item(json, "type");
 	cJSON *i_in_user_list = get_json_item(json, "in_user_list");
 	cJSON *i_typing       = get_json_item(json, "typing");
 
-	if(cJSON_IsArray(i_pic)) pic_from_json(i_pic, &this->pic);
-	if(cJSON_IsString(i_name)) this->name = json_as_string(i_name);
-	if(cJSON_IsNumber(i_x))    this->x = i_x->valueint;
-	if(cJSON_IsNumber(i_y))    this->y = i_y->valueint;
-	if(cJSON_IsNumber(i_dir))  this->update_direction(i_dir->valueint);
-	if(cJSON_IsArray(i_passengers)) {
+	if(i_id) id_from_json(i_id, out->id_buffer, &out->id);
+	if(cJSON_GetArraySize(i_pic) == 3) {
+		cJSON *i_sheet = cJSON_GetArrayItem(i_pic, 0);
+		cJSON *i_pic_x = cJSON_GetArrayItem(i_pic, 1);
+		cJSON *i_pic_y = cJSON_GetArrayItem(i_pic, 2);
+		if((cJSON_IsString(i_sheet) || cJSON_IsNumber(i_sheet)) && cJSON_IsNumber(i_pic_x) && cJSON_IsNumber(i_pic_y)) {
+			out->has_pic = true;
+			id_from_json(i_sheet, out->pic_sheet_buffer, &out->pic_sheet);
+			out->pic_x = i_pic_x->valueint;
+			out->pic_y = i_pic_y->valueint;
+		}
+	}
+	if(cJSON_IsString(i_name)) {
+		out->has_name = true;
+		out->name = std::string_view(i_name->valuestring);
+	}
+	if(cJSON_IsNumber(i_x)) {
+		out->has_x = true;
+		out->x = i_x->valueint;
+	}
+	if(cJSON_IsNumber(i_y)) {
+		out->has_y = true;
+		out->y = i_y->valueint;
+	}
+	if(cJSON_IsNumber(i_dir)) {
+		out->has_dir = true;
+		out->dir = i_dir->valueint;
+	}
+	if(cJSON_IsArray(i_passengers))
+		out->passengers = i_passengers;
+	if(cJSON_IsString(i_vehicle)) {
+		out->has_vehicle = true;
+		out->vehicle = std::string_view(i_vehicle->valuestring);
+	}
+	out->has_is_following = i_is_following != NULL;
+	out->is_following     = cJSON_IsTrue(i_is_following);
+	out->has_in_user_list = i_in_user_list != NULL;
+	out->in_user_list     = cJSON_IsTrue(i_in_user_list);
+	out->has_typing       = i_typing != NULL;
+	out->is_typing        = cJSON_IsTrue(i_typing);
+	if(i_offset) {
+		out->has_offset = true;
+		out->offset_valid = unpack_json_int_array(i_offset, 2, &out->offset_x, &out->offset_y);
+	}
+}
+
+// Returns true if the picture is on a different tile sheet now
+bool Entity::apply_update(const EntityUpdate *update, EntityTable *table) {
+	bool sheet_changed = false;
+	if(update->has_pic && (this->pic.key != update->pic_sheet || this->pic.x != update->pic_x || this->pic.y != update->pic_y)) {
+		// Only a different picture has to have its texture looked up again
+		sheet_changed = this->pic.key != update->pic_sheet;
+		this->pic.key = std::string(update->pic_sheet);
+		this->pic.x = update->pic_x;
+		this->pic.y = update->pic_y;
+		this->pic.ready_to_draw = false;
+	}
+	if(update->has_name) this->name = std::string(update->name);
+	if(update->has_x)    this->x = update->x;
+	if(update->has_y)    this->y = update->y;
+	if(update->has_x || update->has_y)
+		this->clear_snapshots();
+	if(update->has_dir)  this->update_direction(update->dir);
+	if(update->passengers) {
 		this->passengers.clear();
 		cJSON *passenger;
-		cJSON_ArrayForEach(passenger, i_passengers) {
-			this->passengers.insert(json_as_string(passenger));
+		cJSON_ArrayForEach(passenger, update->passengers) {
+			EntityHandle handle = table->intern(json_as_string(passenger));
+			if(handle)
+				this->passengers.push_back(handle);
 		}
 	}
-	if(cJSON_IsString(i_vehicle)) this->vehicle_id = json_as_string(i_vehicle);
-	if(i_is_following) this->is_following = cJSON_IsTrue(i_is_following);
-	if(i_type);
-	if(i_in_user_list) this->in_user_list = cJSON_IsTrue(i_in_user_list);
-	if(i_typing)       this->is_typing = cJSON_IsTrue(i_typing);
-	if(i_offset) {
-		int offset_x, offset_y;
-		if(unpack_json_int_array(i_offset, 2, &offset_x, &offset_y)) {
-			this->offset_x = offset_x;
-			this->offset_y = offset_y;
+	if(update->has_vehicle)      this->vehicle = table->intern(update->vehicle);
+	if(update->has_is_following) this->is_following = update->is_following;
+	if(update->has_in_user_list) this->in_user_list = update->in_user_list;
+	if(update->has_typing)       this->is_typing = update->is_typing;
+	if(update->has_offset) {
+		if(update->offset_valid) {
+			this->offset_x = update->offset_x;
+			this->offset_y = update->offset_y;
 		} else {
 			this->offset_x = 0;
 			this->offset_y = 0;
 		}
 	}
-	if(i_id) return json_as_string(i_id);
-	return "";
+	return sheet_changed;
 }
 
-MapTileReference::MapTileReference(cJSON *json, TilemapTownClient *client) {
-	if(cJSON_IsString(json)) {
-		// Attempt to look up the tile in the tilesets the client already has
-		auto it = client->tileset.find(json->valuestring);
-		if(it != client->tileset.end()) {
-			// If it's present, record a pointer to that tile instead of allocating a string
-			this->tile = (*it).second;
+// .-------------------------------------------------------
+// | Fast path for MOV and WHO
+// '-------------------------------------------------------
+
+// MOV and WHO updates are most of the traffic on a busy map, and they have a small, fixed shape.
+// This reads them straight out of the message text without building a cJSON tree. Anything it
+// isn't sure about (escaped strings, non-integer numbers, unexpected types) makes it give up,
+// and the message goes through cJSON like everything else.
+
+struct JsonScanner {
+	const char *at;
+	const char *end;
+
+	void skip_space() {
+		while(at < end && (*at == ' ' || *at == '\t' || *at == '\n' || *at == '\r'))
+			at++;
+	}
+
+	bool peek(char c) {
+		skip_space();
+		return at < end && *at == c;
+	}
+
+	bool consume(char c) {
+		if(!peek(c))
+			return false;
+		at++;
+		return true;
+	}
+
+	bool literal(const char *word) {
+		size_t length = strlen(word);
+		skip_space();
+		if((size_t)(end - at) < length || memcmp(at, word, length))
+			return false;
+		at += length;
+		return true;
+	}
+
+	// Strings with escapes are left to cJSON
+	bool string(std::string_view *out) {
+		if(!consume('"'))
+			return false;
+		const char *start = at;
+		while(at < end && *at != '"') {
+			if(*at == '\\')
+				return false;
+			at++;
+		}
+		if(at >= end)
+			return false;
+		*out = std::string_view(start, at - start);
+		at++;
+		return true;
+	}
+
+	bool integer(int *out) {
+		skip_space();
+		bool negative = false;
+		if(at < end && *at == '-') {
+			negative = true;
+			at++;
+		}
+		if(at >= end || *at < '0' || *at > '9')
+			return false;
+		long value = 0;
+		while(at < end && *at >= '0' && *at <= '9') {
+			value = value * 10 + (*at - '0');
+			if(value > 0x7fffffff)
+				return false;
+			at++;
+		}
+		if(at < end && (*at == '.' || *at == 'e' || *at == 'E'))
+			return false;
+		*out = negative ? -value : value;
+		return true;
+	}
+
+	bool int_array(int count, int *out) {
+		if(!consume('['))
+			return false;
+		for(int i=0; i<count; i++) {
+			if(i && !consume(','))
+				return false;
+			if(!integer(&out[i]))
+				return false;
+		}
+		return consume(']');
+	}
+
+	// Matches cJSON_IsTrue: anything besides true counts as false
+	bool truthy(bool *out) {
+		if(literal("true")) {
+			*out = true;
+			return true;
+		}
+		*out = false;
+		return skip_value();
+	}
+
+	// A string or a number, with numbers converted to text
+	bool id(char *buffer, std::string_view *out) {
+		if(peek('"'))
+			return string(out);
+		int value;
+		if(!integer(&value))
+			return false;
+		id_from_int(value, buffer, out);
+		return true;
+	}
+
+	bool skip_value() {
+		skip_space();
+		if(at >= end)
+			return false;
+		if(*at == '"') {
+			at++;
+			while(at < end && *at != '"') {
+				if(*at == '\\')
+					at++;
+				at++;
+			}
+			if(at >= end)
+				return false;
+			at++;
+			return true;
+		}
+		if(*at == '{' || *at == '[') {
+			char close = (*at == '{') ? '}' : ']';
+			at++;
+			if(consume(close))
+				return true;
+			do {
+				if(close == '}') {
+					if(!skip_value() || !consume(':'))
+						return false;
+				}
+				if(!skip_value())
+					return false;
+			} while(consume(','));
+			return consume(close);
+		}
+		// Numbers and literals
+		const char *start = at;
+		while(at < end && *at != ',' && *at != '}' && *at != ']' && *at != ' ' && *at != '\n' && *at != '\r' && *at != '\t')
+			at++;
+		return at != start;
+	}
+
+	bool done() {
+		skip_space();
+		return at == end;
+	}
+};
+
+// cJSON goes with the first of a repeated key, where the decoders below would end up with the last one.
+// Returns true the second time one of the keys in the list is seen, so the message can be left to cJSON.
+static bool is_repeated_key(std::string_view key, const char *const *keys, unsigned int *seen) {
+	for(unsigned int i=0; keys[i]; i++) {
+		if(key == keys[i]) {
+			if(*seen & (1 << i))
+				return true;
+			*seen |= 1 << i;
+			return false;
+		}
+	}
+	return false;
+}
+
+static const char *const mov_keys[] = {"id", "to", "dir", "offset", "from", NULL};
+static const char *const entity_update_keys[] = {"id", "name", "pic", "x", "y", "dir", "vehicle", "is_following", "in_user_list", "typing", "offset", "passengers", NULL};
+
+static bool mov_update_from_text(const char *text, size_t length, MovUpdate *out) {
+	*out = MovUpdate();
+	JsonScanner scan = {text, text + length};
+	bool has_id = false;
+	unsigned int seen = 0;
+
+	if(!scan.consume('{'))
+		return false;
+	if(!scan.peek('}')) {
+		do {
+			std::string_view key;
+			if(!scan.string(&key) || !scan.consume(':') || is_repeated_key(key, mov_keys, &seen))
+				return false;
+			if(key == "id") {
+				if(!scan.id(out->id_buffer, &out->id))
+					return false;
+				has_id = true;
+			} else if(key == "to") {
+				if(!scan.int_array(2, &out->to_x))
+					return false;
+				out->has_to = true;
+			} else if(key == "dir") {
+				if(!scan.integer(&out->dir))
+					return false;
+				out->has_dir = true;
+			} else if(key == "offset") {
+				out->has_offset = true;
+				if(scan.peek('[')) {
+					if(!scan.int_array(2, &out->offset_x))
+						return false;
+					out->offset_valid = true;
+				} else if(!scan.skip_value()) {
+					return false;
+				}
+			} else {
+				if(key == "from")
+					out->has_from = true;
+				if(!scan.skip_value())
+					return false;
+			}
+		} while(scan.consume(','));
+	}
+	return scan.consume('}') && scan.done() && has_id;
+}
+
+static bool entity_update_from_text(JsonScanner *scan, EntityUpdate *out) {
+	*out = EntityUpdate();
+	unsigned int seen = 0;
+	if(!scan->consume('{'))
+		return false;
+	if(scan->consume('}'))
+		return true;
+	do {
+		std::string_view key;
+		if(!scan->string(&key) || !scan->consume(':') || is_repeated_key(key, entity_update_keys, &seen))
+			return false;
+		bool ok;
+		if(key == "id") {
+			ok = scan->id(out->id_buffer, &out->id);
+		} else if(key == "name" && scan->peek('"')) {
+			ok = out->has_name = scan->string(&out->name);
+		} else if(key == "pic" && scan->consume('[')) {
+			ok = scan->id(out->pic_sheet_buffer, &out->pic_sheet)
+			  && scan->consume(',') && scan->integer(&out->pic_x)
+			  && scan->consume(',') && scan->integer(&out->pic_y)
+			  && scan->consume(']');
+			out->has_pic = ok;
+		} else if(key == "x" && !scan->peek('n')) {
+			ok = out->has_x = scan->integer(&out->x);
+		} else if(key == "y" && !scan->peek('n')) {
+			ok = out->has_y = scan->integer(&out->y);
+		} else if(key == "dir" && !scan->peek('n')) {
+			ok = out->has_dir = scan->integer(&out->dir);
+		} else if(key == "vehicle" && scan->peek('"')) {
+			ok = out->has_vehicle = scan->string(&out->vehicle);
+		} else if(key == "is_following") {
+			ok = out->has_is_following = scan->truthy(&out->is_following);
+		} else if(key == "in_user_list") {
+			ok = out->has_in_user_list = scan->truthy(&out->in_user_list);
+		} else if(key == "typing") {
+			ok = out->has_typing = scan->truthy(&out->is_typing);
+		} else if(key == "offset") {
+			out->has_offset = true;
+			if(scan->peek('[')) {
+				ok = out->offset_valid = scan->int_array(2, &out->offset_x);
+			} else {
+				ok = scan->skip_value();
+			}
+		} else if(key == "passengers" && scan->peek('[')) {
+			ok = false; // Needs cJSON
+		} else {
+			ok = scan->skip_value();
+		}
+		if(!ok)
+			return false;
+	} while(scan->consume(','));
+	return scan->consume('}');
+}
+
+// Returns false if the message should be handled by the regular cJSON path instead
+bool TilemapTownClient::websocket_message_fast(const char *text, size_t length) {
+	if(length < 5)
+		return false;
+	int command = protocol_command_as_int(text[0], text[1], text[2]);
+
+	if(command == protocol_command_as_int('M', 'O', 'V')) {
+		MovUpdate mov;
+		if(!mov_update_from_text(text+4, length-4, &mov))
+			return false;
+		this->apply_mov(&mov);
+		return true;
+	}
+
+	if(command == protocol_command_as_int('W', 'H', 'O')) {
+		// Only the messages that add or update a single entity; the full list and renames are rare
+		JsonScanner scan = {text+4, text+length};
+		std::string_view key;
+		if(!scan.consume('{') || !scan.string(&key) || !scan.consume(':'))
+			return false;
+		if(key != "add" && key != "update")
+			return false;
+		EntityUpdate update;
+		if(!entity_update_from_text(&scan, &update) || !scan.consume('}') || !scan.done())
+			return false;
+		if(key == "add")
+			this->apply_who_add(&update);
+		else
+			this->apply_who_update(&update);
+		return true;
+	}
+	return false;
+}
+
+// .-------------------------------------------------------
+// | Checking the fast path against cJSON
+// '-------------------------------------------------------
+
+static bool same_mov_update(const MovUpdate *a, const MovUpdate *b) {
+	return a->id == b->id && a->has_from == b->has_from
+		&& a->has_to == b->has_to && (!a->has_to || (a->to_x == b->to_x && a->to_y == b->to_y))
+		&& a->has_dir == b->has_dir && (!a->has_dir || a->dir == b->dir)
+		&& a->has_offset == b->has_offset && a->offset_valid == b->offset_valid
+		&& (!a->offset_valid || (a->offset_x == b->offset_x && a->offset_y == b->offset_y));
+}
+
+static bool same_entity_update(const EntityUpdate *a, const EntityUpdate *b) {
+	return a->id == b->id
+		&& a->has_name == b->has_name && (!a->has_name || a->name == b->name)
+		&& a->has_pic == b->has_pic && (!a->has_pic || (a->pic_sheet == b->pic_sheet && a->pic_x == b->pic_x && a->pic_y == b->pic_y))
+		&& a->has_x == b->has_x && (!a->has_x || a->x == b->x)
+		&& a->has_y == b->has_y && (!a->has_y || a->y == b->y)
+		&& a->has_dir == b->has_dir && (!a->has_dir || a->dir == b->dir)
+		&& a->has_offset == b->has_offset && a->offset_valid == b->offset_valid
+		&& (!a->offset_valid || (a->offset_x == b->offset_x && a->offset_y == b->offset_y))
+		&& a->has_vehicle == b->has_vehicle && (!a->has_vehicle || a->vehicle == b->vehicle)
+		&& a->has_is_following == b->has_is_following && a->is_following == b->is_following
+		&& a->has_in_user_list == b->has_in_user_list && a->in_user_list == b->in_user_list
+		&& a->has_typing == b->has_typing && a->is_typing == b->is_typing
+		&& !a->passengers && !b->passengers;
+}
+
+// Decodes a MOV or WHO with both the fast path scanner and cJSON, and returns false if they came out different.
+// checked is set to false for other messages, and for ones the fast path would leave to cJSON anyway.
+bool update_decoders_agree(const char *text, size_t length, bool *checked) {
+	*checked = false;
+	if(length < 5)
+		return true;
+	int command = protocol_command_as_int(text[0], text[1], text[2]);
+	bool agree = true;
+
+	if(command == protocol_command_as_int('M', 'O', 'V')) {
+		MovUpdate fast, slow;
+		if(!mov_update_from_text(text+4, length-4, &fast))
+			return true;
+		cJSON *json = cJSON_ParseWithLength(text+4, length-4);
+		*checked = true;
+		agree = mov_update_from_json(json, &slow) && same_mov_update(&fast, &slow);
+		cJSON_Delete(json);
+	} else if(command == protocol_command_as_int('W', 'H', 'O')) {
+		JsonScanner scan = {text+4, text+length};
+		std::string_view key;
+		EntityUpdate fast, slow;
+		if(!scan.consume('{') || !scan.string(&key) || !scan.consume(':') || (key != "add" && key != "update"))
+			return true;
+		if(!entity_update_from_text(&scan, &fast) || !scan.consume('}') || !scan.done())
+			return true;
+		cJSON *json = cJSON_ParseWithLength(text+4, length-4);
+		cJSON *i_update = get_json_item(json, key == "add" ? "add" : "update");
+		*checked = true;
+		agree = cJSON_IsObject(i_update);
+		if(agree) {
+			entity_update_from_json(i_update, &slow);
+			agree = same_entity_update(&fast, &slow);
+		}
+		cJSON_Delete(json);
+	}
+	return agree;
+}
+
+void TilemapTownClient::apply_mov(const MovUpdate *mov) {
+	EntityHandle handle = this->entities.find(mov->id);
+	if(!handle)
+		return;
+	// Your own movement gets checked against what was predicted instead
+	bool is_you = handle == this->your_handle;
+	if(is_you) {
+		if(mov->has_to)
+			this->reconcile_position(mov->to_x, mov->to_y, mov->has_from);
+		// Echoes only repeat what you already did
+		if(mov->has_from)
+			return;
+	}
+	Entity *entity = this->entities.get(handle);
+	if(!entity)
+		return;
+
+	if(mov->has_to) {
+		if(!is_you) {
+			this->remote_entity_moved(entity, mov->to_x, mov->to_y);
+			entity->x = mov->to_x;
+			entity->y = mov->to_y;
+			this->entity_grid.update(entity);
+		}
+		if(!entity->vehicle || entity->is_following) {
+			entity->walk_until = get_time_us() + WALK_ANIMATION_US;
+		}
+	}
+
+	if(mov->has_offset) {
+		if(mov->offset_valid) {
+			entity->offset_x = mov->offset_x;
+			entity->offset_y = mov->offset_y;
 		} else {
-			// If it's not present, hold onto the string until it can be turned into a tile later
-			this->tile = std::string(json->valuestring);
+			entity->offset_x = 0;
+			entity->offset_y = 0;
 		}
+	}
+
+	if(mov->has_dir) {
+		entity->update_direction(mov->dir);
+	}
+}
+
+void TilemapTownClient::apply_who_add(const EntityUpdate *update) {
+	if(update->id.empty())
+		return;
+	EntityHandle handle = this->entities.intern(update->id);
+	Entity *existing = this->entities.get(handle);
+	if(existing)
+		this->entity_grid.remove(existing);
+	Entity *entity = this->entities.add(handle);
+	if(!entity)
+		return;
+	if(entity->apply_update(update, &this->entities))
+		this->track_tile_sheet(handle, entity);
+	this->entity_grid.update(entity);
+	// Your handle goes stale if you were removed, so pick it back up when you're added again
+	if(handle != this->your_handle && update->id == this->your_id)
+		this->your_handle = handle;
+	if(handle == this->your_handle)
+		this->reset_prediction();
+}
+
+// A full list of who's on the map. Entities that were already known get updated in place, so anything
+// worked out locally, like their textures, carries over, and the ones that aren't in the list anymore are removed.
+void TilemapTownClient::apply_who_list(cJSON *list) {
+	uint32_t serial = ++this->entities.list_serial;
+
+	cJSON *i_user;
+	cJSON_ArrayForEach(i_user, list) {
+		if(!cJSON_IsObject(i_user))
+			break;
+		EntityUpdate update;
+		entity_update_from_json(i_user, &update);
+		EntityHandle handle = this->entities.intern(update.id);
+		EntitySlot *slot = this->entities.get_slot(handle);
+		if(!slot)
+			continue;
+		Entity *entity;
+		if(slot->present) {
+			entity = &slot->entity;
+			// The list has everything about the entity, so anything left out goes back to how a new entity would have it
+			if(!update.passengers)       entity->passengers.clear();
+			if(!update.has_vehicle)      entity->vehicle = 0;
+			if(!update.has_is_following) entity->is_following = false;
+			if(!update.has_in_user_list) entity->in_user_list = false;
+			if(!update.has_typing)       entity->is_typing = false;
+			if(!update.has_offset)       entity->offset_x = entity->offset_y = 0;
+		} else {
+			entity = this->entities.add(handle);
+		}
+		if(entity->apply_update(&update, &this->entities))
+			this->track_tile_sheet(handle, entity);
+		this->entity_grid.update(entity);
+		slot->listed = serial;
+	}
+
+	// Whatever a listed entity links to keeps its slot, even if it hasn't been added, so the link works once it is
+	auto keep_linked = [&](EntityHandle handle) {
+		EntitySlot *linked = this->entities.get_slot(handle);
+		if(linked)
+			linked->linked = serial;
+	};
+	for(EntitySlot &slot : this->entities.slots) {
+		if(!slot.present || slot.listed != serial)
+			continue;
+		keep_linked(slot.entity.vehicle);
+		for(EntityHandle passenger : slot.entity.passengers)
+			keep_linked(passenger);
+	}
+
+	// Entities that weren't in the list are gone. So are IDs that nothing links to anymore, like a vehicle that
+	// never got added, which would otherwise hold onto their slots for the rest of the session
+	for(size_t i=0; i<this->entities.slots.size(); i++) {
+		EntitySlot *slot = &this->entities.slots[i];
+		if(!slot->in_use || slot->listed == serial)
+			continue;
+		if(slot->present)
+			this->entity_grid.remove(&slot->entity);
+		if(slot->linked == serial)
+			this->entities.remove_keeping_id(this->entities.handle_at(i));
+		else
+			this->entities.remove(this->entities.handle_at(i));
+	}
+
+	// You might have been removed and added back
+	this->your_handle = this->entities.intern(this->your_id);
+	this->reset_prediction();
+}
+
+void TilemapTownClient::apply_who_update(const EntityUpdate *update) {
+	EntityHandle handle = this->entities.find(update->id);
+	Entity *entity = this->entities.get(handle);
+	if(!entity)
+		return;
+	if(handle == this->your_handle && update->has_x && update->has_y) {
+		// The server moved you, so check it against any steps in flight like with MOV
+		int x = entity->x, y = entity->y;
+		if(entity->apply_update(update, &this->entities))
+			this->track_tile_sheet(handle, entity);
+		int new_x = entity->x, new_y = entity->y;
+		entity->x = x;
+		entity->y = y;
+		this->reconcile_position(new_x, new_y, false);
+		return;
+	}
+	if(entity->apply_update(update, &this->entities))
+		this->track_tile_sheet(handle, entity);
+	if(update->has_x || update->has_y)
+		this->entity_grid.update(entity);
+}
+
+MapTileReference::MapTileReference(cJSON *json, TilemapTownClient *client) {
+	if(cJSON_IsString(json)) {
+		this->tile = client->get_tile_by_key(json->valuestring);
 	} else if(cJSON_IsObject(json)) {
 		MapTileInfo tile_info = MapTileInfo();
-		if(map_tile_from_json(json, &tile_info)) {
+		if(map_tile_from_json(json, &tile_info, client)) {
 			this->tile = client->get_shared_pointer_to_tile(&tile_info);
 		}
 	}
 }
 
+static void record_command_timing(TilemapTownClient *client, const char *text, size_t length, uint64_t started_at, uint64_t parsed_at, bool fast_path) {
+	CommandTiming *timing = &client->command_timing[protocol_command_as_int(text[0], text[1], text[2])];
+	uint64_t now = get_time_us();
+	timing->count++;
+	timing->bytes += length;
+	timing->parse_us += parsed_at - started_at;
+	timing->apply_us += now - parsed_at;
+	if(fast_path)
+		timing->fast_path++;
+}
+
 void TilemapTownClient::websocket_message(const char *text, size_t length) {
 	if(length < 3)
 		return;
@@ -318,6 +954,8 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 		// Batch messages need special parsing
 		if(text[0] == 'B' && text[1] == 'A' && text[2] == 'T' && text[3] == ' ') {
 			size_t base = 4, scan = 4;
+			bool was_in_batch = this->in_batch;
+			this->in_batch = true;
 			while(scan < length) {
 				if(text[scan] == '\n') {
 					this->websocket_message(text+base, scan-base);
@@ -326,58 +964,57 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 				scan++;
 			}
 			this->websocket_message(text+base, scan-base);
+			this->in_batch = was_in_batch;
+
+			// Things that are cheaper to do once for the whole batch
+			if(!this->in_batch)
+				this->apply_tile_sheet_updates();
 			return;
-		} else {
-			json = cJSON_ParseWithLength(text+4, length-4);
 		}
 	}
+
+	uint64_t started_at = this->time_commands ? get_time_us() : 0;
+	if(length > 4) {
+		if(!this->disable_fast_path) {
+			if(this->websocket_message_fast(text, length)) {
+				this->inbound_stats.fast_path++;
+				if(this->time_commands)
+					record_command_timing(this, text, length, started_at, started_at, true);
+				return;
+			}
+			int command = protocol_command_as_int(text[0], text[1], text[2]);
+			if(command == protocol_command_as_int('M', 'O', 'V') || command == protocol_command_as_int('W', 'H', 'O'))
+				this->inbound_stats.fallback++;
+		}
+		json = cJSON_ParseWithLength(text+4, length-4);
+	}
+	uint64_t parsed_at = this->time_commands ? get_time_us() : 0;
 	// printf("Received %c%c%c\n", text[0], text[1], text[2]);
 
 	switch(protocol_command_as_int(text[0], text[1], text[2])) {
 		case protocol_command_as_int('P', 'I', 'N'):
+			if(this->ping_sent_at) {
+				// Reply to our own PIN, so don't answer it
+				this->pin_round_trips_us.push_back(get_time_us() - this->ping_sent_at);
+				this->ping_sent_at = 0;
+				break;
+			}
 			this->websocket_write("PIN");
 			break;
 
-		case protocol_command_as_int('M', 'O', 'V'):
+		case protocol_command_as_int('I', 'D', 'N'):
 		{
-			cJSON *i_to   = get_json_item(json, "to");
-			cJSON *i_from = get_json_item(json, "from");
-			cJSON *i_dir  = get_json_item(json, "dir");
-			cJSON *i_id   = get_json_item(json, "id");
-			cJSON *i_offset = get_json_item(json, "offset");
-			if(!cJSON_IsString(i_id) && !cJSON_IsNumber(i_id))
-				break;
-			std::string str_id = json_as_string(i_id);
-			if(str_id == this->your_id && i_from)
-				break;
-			// Find this entity
-			auto it = this->who.find(str_id);
-			if(it != this->who.end()) {
-				int to_x, to_y, offset_x, offset_y;
-				Entity *entity = &(*it).second;
-
-				if(unpack_json_int_array(i_to, 2, &to_x, &to_y)) {
-					entity->x = to_x;
-					entity->y = to_y;
-					if(entity->vehicle_id.empty() || entity->is_following) {
-						entity->walk_timer = 30+1; // 30*(16.6666ms/1000) = 0.5
-					}
-				}
-
-				if(i_offset) {
-					if(unpack_json_int_array(i_offset, 2, &offset_x, &offset_y)) {
-						entity->offset_x = offset_x;
-						entity->offset_y = offset_y;
-					} else {
-						entity->offset_x = 0;
-						entity->offset_y = 0;
-					}
-				}
+			// The server lists which of the requested features it's going to use
+			cJSON *i_features = get_json_item(json, "features");
+			this->server_supports_batch = cJSON_IsObject(get_json_item(i_features, "batch"));
+			break;
+		}
 
-				if(cJSON_IsNumber(i_dir)) {
-					entity->update_direction(i_dir->valueint);
-				}
-			}
+		case protocol_command_as_int('M', 'O', 'V'):
+		{
+			MovUpdate mov;
+			if(mov_update_from_json(json, &mov))
+				this->apply_mov(&mov);
 			break;
 		}
 
@@ -385,7 +1022,15 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 		{
 // <-- MAI {"name": map_name, "id": map_id, "owner": whoever, "admins": list, "default": default_turf, "size": [width, height], "public": true/false, "private": true/false, "build_enabled": true/false, "full_sandbox": true/false, "you_allow": list, "you_deny": list
 			this->json_tileset.clear();
+			this->predicted_moves.clear();
+			this->cancel_walk();
 			this->map_received = false;
+			this->map_started_at = get_time_us();
+			this->waiting_for_tile_sheets = true;
+			this->map_tile_sheets_waiting.clear();
+			this->ticks_since_map = 0;
+			this->map_tile_sheets_abandoned.clear();
+			this->tile_sheets_requested = 0;
 
 			//cJSON *i_name          = get_json_item(json, "name");
 			cJSON *i_id            = get_json_item(json, "id");
@@ -403,7 +1048,10 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 			int width, height;
 			if(unpack_json_int_array(i_size, 2, &width, &height)) {
 				this->town_map.init_map(width, height);
+				this->rebuild_entity_grid();
 			}
+			// Forget placeholders that only the old map was using
+			std::erase_if(this->pending_tiles, [](const auto &item) { return item.second.use_count() == 1; });
 			if(cJSON_IsNumber(i_id)) {
 				this->town_map.id = i_id->valueint;
 			} else {
@@ -433,6 +1081,7 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 					for(int y=y1; y<=y2; y++) {
 						int index = y * this->town_map.width + x;
 						this->town_map.cells[index] = MapCell(default_tile);
+						this->update_cell_collision(index);
 					}
 				}
 			}
@@ -448,6 +1097,7 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 				if(cJSON_IsNumber(i_x) && cJSON_IsNumber(i_y)) {
 					int index = i_y->valueint * this->town_map.width + i_x->valueint;
 					this->town_map.cells[index] = MapCell(MapTileReference(i_tile, this));
+					this->update_cell_collision(index);
 				}
 			}
 
@@ -467,6 +1117,7 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 					cJSON_ArrayForEach(object, i_tile) {
 						objs->push_back(MapTileReference(object, this));
 					}
+					this->update_cell_collision(index);
 				}
 			}
 			
@@ -532,6 +1183,7 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 								cell->turf = copy_buffer[rect_index].turf;
 							if(b_copy_obj)
 								cell->objs = copy_buffer[rect_index].objs;
+							this->update_cell_collision(map_index);
 						}
 					}
 
@@ -566,6 +1218,7 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 								continue;
 							size_t map_index = map_y * this->town_map.width + map_x;
 							this->town_map.cells[map_index].turf = tile;
+							this->update_cell_collision(map_index);
 						}
 					}
 				}
@@ -604,6 +1257,7 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 								continue;
 							size_t map_index = map_y * this->town_map.width + map_x;
 							this->town_map.cells[map_index].objs = objs;
+							this->update_cell_collision(map_index);
 						}
 					}
 				}
@@ -617,45 +1271,40 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 			cJSON *i_you = get_json_item(json, "you");
 			if(i_you) {
 				this->your_id = json_as_string(i_you);
+				this->your_handle = this->entities.intern(this->your_id);
 			}
 
 			cJSON *i_list = get_json_item(json, "list");
 			if(cJSON_IsObject(i_list)) {
-				this->who.clear();
-
-				cJSON *i_user;
-				cJSON_ArrayForEach(i_user, i_list) {
-					if(!cJSON_IsObject(i_user))
-						break;
-					Entity entity = Entity();
-					std::string id = entity.apply_json(i_user);
-					if(!id.empty())
-						this->who[id] = entity;
-				}
+				this->apply_who_list(i_list);
 			}
 
 			cJSON *i_add = get_json_item(json, "add");
 			if(cJSON_IsObject(i_add)) {
-				Entity entity = Entity();
-				std::string id = entity.apply_json(i_add);
-				if(!id.empty())
-					this->who[id] = entity;
+				EntityUpdate update;
+				entity_update_from_json(i_add, &update);
+				this->apply_who_add(&update);
 			}
 
 			cJSON *i_update = get_json_item(json, "update");
 			if(cJSON_IsObject(i_update)) {
-				cJSON *i_id = get_json_item(i_add, "id");
-				if(!i_id) break;
-
-				auto it = this->who.find(json_as_string(i_id));
-				if(it != this->who.end()) {
-					(*it).second.apply_json(i_update);
-				}
+				EntityUpdate update;
+				entity_update_from_json(i_update, &update);
+				if(update.id.data())
+					this->apply_who_update(&update);
 			}
 
 			cJSON *i_remove = get_json_item(json, "remove");
 			if(cJSON_IsString(i_remove) || cJSON_IsNumber(i_remove)) {
-				this->who.erase(json_as_string(i_remove));
+				EntityHandle handle = this->entities.find(json_as_string(i_remove));
+				Entity *entity = this->entities.get(handle);
+				if(entity)
+					this->entity_grid.remove(entity);
+				// Something riding it or carrying it would lose track of it if it came back with a new handle
+				if(this->entities.is_linked(handle))
+					this->entities.remove_keeping_id(handle);
+				else
+					this->entities.remove(handle);
 			}
 
 			cJSON *i_new_id = get_json_item(json, "new_id");
@@ -667,14 +1316,22 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 				std::string str_id     = json_as_string(i_id);
 				std::string str_new_id = json_as_string(i_id2);
 
-				if(str_id == this->your_id) {
-					this->your_id = str_new_id;
+				// The entity keeps its handle, so links to it from other entities still work
+				EntityHandle handle = this->entities.find(str_id);
+				if(this->entities.get(handle)) {
+					EntityHandle existing = this->entities.find(str_new_id);
+					if(existing && existing != handle) {
+						Entity *replaced = this->entities.get(existing);
+						if(replaced)
+							this->entity_grid.remove(replaced);
+						this->entities.remove(existing);
+					}
+					this->entities.rename(handle, str_new_id);
 				}
 
-				auto it = this->who.find(str_id);
-				if(it != this->who.end()) {
-					this->who[str_new_id] = (*it).second;
-					this->who.erase(str_id);
+				if(str_id == this->your_id) {
+					this->your_id = str_new_id;
+					this->your_handle = this->entities.intern(this->your_id);
 				}
 			}
 			break;
@@ -739,12 +1396,13 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 						std::string key = std::string(tile_in_tileset->string);
 
 						struct MapTileInfo tile = MapTileInfo();
-						map_tile_from_json(tile_in_tileset, &tile);
-						tile.key = key;
+						map_tile_from_json(tile_in_tileset, &tile, this);
+						tile.meta->key = key;
 
-						this->tileset[prefix+key] = std::make_shared<MapTileInfo>(tile);
+						this->define_tile(prefix+key, &tile);
 					}
 				}
+				this->rebuild_collision();
 			}
 			break;
 		}
@@ -755,25 +1413,20 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 			cJSON *i_update = get_json_item(json, "update");
 
 			const char *i_url = get_json_string(json, "url");
-			if(i_id) {
+			if(i_id && i_url) {
 				std::string id = json_as_string(i_id);
 				this->url_for_tile_sheet[id] = i_url;
 				this->requested_tile_sheets.erase(id);
+				this->map_tile_sheets_waiting.erase(id);
 
-				// Update images that are on preexisting tiles
+				// Update images that are on preexisting tiles, all at once if this is part of a batch
 				if(cJSON_IsTrue(i_update)) {
-					for (auto value : this->tileset) {
-						if((*value.second).pic.key == id) {
-							(*value.second).pic.ready_to_draw = false;
-						}
-					}
-					for (auto value : this->json_tileset) {
-						std::shared_ptr<MapTileInfo> tile = value.second.lock();
-						if((*tile).pic.key == id) {
-							(*tile).pic.ready_to_draw = false;
-						}
-					}
+					this->updated_tile_sheets.insert(id);
+					if(!this->in_batch)
+						this->apply_tile_sheet_updates();
 				}
+
+				this->finish_tile_sheet_wait();
 			}
 			break;
 		}
@@ -843,7 +1496,7 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 			const char *i_name  = get_json_string(json, "name");
 			//const char *i_class = get_json_string(json, "class");
 			//cJSON *i_buttons    = get_json_item(json, "buttons");
-			if(i_text) {
+			if(i_text && !this->quiet_chat) {
 				if(i_name) {
 					if(i_text[0] == '/' && i_text[1] == 'm' && i_text[2] == 'e' && i_text[3] == ' ') {
 						printf("* %s %s\n", i_name, i_text+4);
@@ -864,28 +1517,111 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 
 	if(json)
 		cJSON_Delete(json);
+	if(this->time_commands)
+		record_command_timing(this, text, length, started_at, parsed_at, false);
 }
 
-void TilemapTownClient::websocket_write(std::string command, cJSON *json) {
-	if(json == NULL) {
-		this->websocket_write(command);
+void TilemapTownClient::request_image_asset(std::string key) {
+	// Even if an earlier map already asked for it, this one is still waiting on it
+	if(this->waiting_for_tile_sheets && !this->map_tile_sheets_abandoned.contains(key)) {
+		if(this->map_tile_sheets_waiting.insert(key).second)
+			this->tile_sheets_requested++;
+	}
+	if(this->requested_tile_sheets.find(key) != this->requested_tile_sheets.end()) {
 		return;
 	}
-	char *as_string = cJSON_PrintUnformatted(json);
-	if(!as_string)
+	this->requested_tile_sheets[key] = 0; // Timed from when it's actually sent
+
+	// Collect all of the keys the renderer asks for, and send them together
+	this->pending_image_requests.push_back(key);
+}
+
+void TilemapTownClient::flush_image_requests() {
+	uint64_t now = get_time_us();
+
+	// Give up on requests that never got a reply, so they stop holding up the timer and can be asked for again
+	std::erase_if(this->requested_tile_sheets, [&](const auto &item) {
+		if(!item.second || now - item.second < TILE_SHEET_REQUEST_TIMEOUT_US)
+			return false;
+		if(this->map_tile_sheets_waiting.erase(item.first))
+			this->map_tile_sheets_abandoned.insert(item.first);
+		return true;
+	});
+
+	// These all go into the same lane, so they'll be sent as one BAT
+	for(std::string &key : this->pending_image_requests) {
+		cJSON *json = cJSON_CreateObject();
+		cJSON_AddStringToObject(json, "id", key.c_str());
+		this->websocket_write("IMG", json);
+		cJSON_Delete(json);
+		this->requested_tile_sheets[key] = now;
+	}
+	this->pending_image_requests.clear();
+
+	if(this->map_received && this->ticks_since_map < 2)
+		this->ticks_since_map++;
+	this->finish_tile_sheet_wait();
+}
+
+// Stops the timer once every tile sheet the current map asked for has a URL or was given up on,
+// which is right away for a map that didn't need to ask for any
+void TilemapTownClient::finish_tile_sheet_wait() {
+	if(!this->waiting_for_tile_sheets || this->ticks_since_map < 2)
+		return;
+	if(!this->map_tile_sheets_waiting.empty() || !this->pending_image_requests.empty())
 		return;
-	this->websocket_write(command + " " + std::string(as_string));
-	free(as_string);
+	this->waiting_for_tile_sheets = false;
+	this->tile_sheets_resolved_us = get_time_us() - this->map_started_at;
 }
 
-void TilemapTownClient::request_image_asset(std::string key) {
-	if(this->requested_tile_sheets.find(key) != this->requested_tile_sheets.end()) {
+void TilemapTownClient::apply_tile_sheet_updates() {
+	if(this->updated_tile_sheets.empty())
 		return;
+
+	// Tiles all get their texture through the TileSheet, and the only entities that get looked at are the ones that use the updated sheets
+	for(const std::string &key : this->updated_tile_sheets) {
+		auto sheet = this->tile_sheet_handles.find(key);
+		if(sheet != this->tile_sheet_handles.end())
+			this->tile_sheets[(*sheet).second].ready_to_draw = false;
+
+		auto it = this->sheet_dependents.find(key);
+		if(it == this->sheet_dependents.end())
+			continue;
+		SheetDependents *dependents = &(*it).second;
+
+		for(size_t i=0; i<dependents->entities.size();) {
+			Entity *entity = this->entities.get(dependents->entities[i]);
+			if(!entity || entity->pic.key != key) {
+				dependents->entities[i] = dependents->entities.back();
+				dependents->entities.pop_back();
+				continue;
+			}
+			entity->pic.ready_to_draw = false;
+			i++;
+		}
+
+		if(dependents->entities.empty())
+			this->sheet_dependents.erase(it);
 	}
-	this->requested_tile_sheets.insert(key);
+	this->updated_tile_sheets.clear();
+}
 
-	cJSON *json = cJSON_CreateObject();
-	cJSON_AddStringToObject(json, "id", key.c_str());
-	this->websocket_write("IMG", json);
-	cJSON_Delete(json);
+static void prune_sheet_dependents(TilemapTownClient *client, const std::string &key, SheetDependents *dependents) {
+	// An entity that went to another sheet and came back is in here twice
+	std::sort(dependents->entities.begin(), dependents->entities.end());
+	dependents->entities.erase(std::unique(dependents->entities.begin(), dependents->entities.end()), dependents->entities.end());
+	std::erase_if(dependents->entities, [&](EntityHandle handle) {
+		Entity *entity = client->entities.get(handle);
+		return !entity || entity->pic.key != key;
+	});
+	dependents->prune_at = std::max((size_t)16, dependents->entities.size() * 2);
+}
+
+void TilemapTownClient::track_tile_sheet(EntityHandle handle, Entity *entity) {
+	if(entity->pic.key.empty())
+		return;
+	SheetDependents *dependents = &this->sheet_dependents[entity->pic.key];
+	if(dependents->entities.size() >= dependents->prune_at)
+		prune_sheet_dependents(this, entity->pic.key, dependents);
+	dependents->entities.push_back(handle);
 }
@@ -18,6 +18,7 @@
  */
 #include "town.hpp"
 #include "cJSON.h"
+#include <algorithm>
 
 using namespace std;
 
@@ -30,6 +31,7 @@ void TownMap::init_map(int width, int height) {
 	this->height = height;
 	this->cells.clear();
 	this->cells.resize(width * height);
+	this->collision.assign(width * height, CellCollision());
 }
 
 // .-------------------------------------------------------
@@ -37,56 +39,80 @@ void TownMap::init_map(int width, int height) {
 // '-------------------------------------------------------
 
 std::shared_ptr<MapTileInfo> TilemapTownClient::get_shared_pointer_to_tile(MapTileInfo *tile) {
-	std::size_t hash = tile->hash();
-	std::shared_ptr<MapTileInfo> ptr;
+	bool created;
+	return this->json_tileset.intern(tile, &created);
+}
+
+// Sheets are never forgotten, so a handle stays good for as long as the client is around
+TileSheetHandle TilemapTownClient::get_tile_sheet(const std::string &key) {
+	if(this->tile_sheets.empty())
+		this->tile_sheets.push_back(TileSheet()); // Handle 0, for tiles without a sheet
+	if(key.empty())
+		return 0;
+
+	auto it = this->tile_sheet_handles.find(key);
+	if(it != this->tile_sheet_handles.end())
+		return (*it).second;
+	if(this->tile_sheets.size() > UINT16_MAX)
+		return 0;
+
+	TileSheetHandle handle = this->tile_sheets.size();
+	TileSheet sheet = TileSheet();
+	sheet.key = key;
+	this->tile_sheets.push_back(sheet);
+	this->tile_sheet_handles[key] = handle;
+	return handle;
+}
 
-	// Look for it in the JSON tileset
-	auto it = this->json_tileset.find(hash);
-	if(it != this->json_tileset.end()) {
-		ptr = (*it).second.lock();
-		if(ptr)
+std::shared_ptr<MapTileInfo> CustomTileTable::intern(const MapTileInfo *tile, bool *created) {
+	std::size_t hash = tile->hash();
+	this->stats.references++;
+
+	auto range = this->tiles.equal_range(hash);
+	for(auto it = range.first; it != range.second; ++it) {
+		std::shared_ptr<MapTileInfo> ptr = (*it).second.lock();
+		if(ptr && ptr->same_definition(tile)) {
+			*created = false;
+			this->stats.bytes_saved += sizeof(MapTileInfo) + sizeof(MapTileMeta) + tile->meta->name.size() + tile->meta->message.size();
 			return ptr;
+		}
 	}
 
-	// Not found, so cache it for later
-	ptr = make_shared<MapTileInfo>(*tile);
-	this->json_tileset[hash] = ptr;
+	// Not found, so keep it for later
+	if(this->tiles.size() >= this->sweep_at)
+		this->sweep();
+	std::shared_ptr<MapTileInfo> ptr = std::make_shared<MapTileInfo>(*tile);
+	this->tiles.emplace(hash, ptr);
+	this->stats.created++;
+	*created = true;
 	return ptr;
 }
 
-MapTileInfo* MapTileReference::get(TilemapTownClient *client) {
-	// If there's a pointer to the tile already, just return that tile
-	if(const auto ptr = std::get_if<std::shared_ptr<MapTileInfo>>(&this->tile)) {
-		return (*ptr).get();
-	}
+// Removes entries for tiles that nothing uses anymore
+void CustomTileTable::sweep() {
+	this->stats.swept += std::erase_if(this->tiles, [](const auto &item) { return item.second.expired(); });
+	this->sweep_at = std::max((size_t)64, this->tiles.size() * 2);
+}
 
-	// Is the tile available yet?
-	if(const auto str = std::get_if<std::string>(&this->tile)) {
-		// Is it in the client's tileset?
-		auto it = client->tileset.find(*str);
-		if(it != client->tileset.end()) {
-			// Keep the reference to avoid needing to look it up next time
-			this->tile = (*it).second;
-			return (*it).second.get();
-		}
-	}
+void CustomTileTable::clear() {
+	this->tiles.clear();
+	this->sweep_at = 0;
+}
 
-	return nullptr;
+size_t CustomTileTable::size() {
+	return this->tiles.size();
 }
 
-MapTileReference::MapTileReference(std::string str, TilemapTownClient *client) {
-	// Is it in the client's tileset?
-	auto it = client->tileset.find(str);
-	if(it != client->tileset.end()) {
-		this->tile = (*it).second;
-		return;
-	}
-	// Otherwise, just store the string
-	this->tile = str;
+// Every reference to a key shares one tile, so this never has to look anything up
+MapTileInfo* MapTileReference::get(TilemapTownClient *client) {
+	MapTileInfo *tile = this->tile.get();
+	if(!tile || tile->pending)
+		return nullptr;
+	return tile;
 }
 
-MapTileReference::MapTileReference(std::string str) {
-	this->tile = str;
+MapTileReference::MapTileReference(std::string str, TilemapTownClient *client) {
+	this->tile = client->get_tile_by_key(str);
 }
 
 MapTileReference::MapTileReference(std::shared_ptr<MapTileInfo> tile) {
@@ -98,7 +124,35 @@ MapTileReference::MapTileReference(MapTileInfo* tile, TilemapTownClient *client)
 }
 
 MapTileReference::MapTileReference() {
-	this->tile = std::monostate();
+}
+
+// Keys that aren't in the tileset yet get a placeholder, shared by everything that refers to that key.
+// define_tile fills it in when RSC gets around to it, which resolves all of those references at once,
+// and a key that never gets defined costs nothing after the message that used it.
+std::shared_ptr<MapTileInfo> TilemapTownClient::get_tile_by_key(const std::string &key) {
+	auto it = this->tileset.find(key);
+	if(it != this->tileset.end())
+		return (*it).second;
+
+	std::shared_ptr<MapTileInfo> &placeholder = this->pending_tiles[key];
+	if(!placeholder) {
+		placeholder = std::make_shared<MapTileInfo>();
+		placeholder->meta = std::make_shared<MapTileMeta>();
+		placeholder->meta->key = key;
+		placeholder->pending = true;
+	}
+	return placeholder;
+}
+
+void TilemapTownClient::define_tile(const std::string &key, const MapTileInfo *tile) {
+	auto it = this->pending_tiles.find(key);
+	if(it != this->pending_tiles.end()) {
+		*(*it).second = *tile;
+		this->tileset[key] = (*it).second;
+		this->pending_tiles.erase(it);
+		return;
+	}
+	this->tileset[key] = std::make_shared<MapTileInfo>(*tile);
 }
 
 std::size_t hash_combine(std::size_t a, std::size_t b) {
@@ -108,18 +162,22 @@ std::size_t hash_combine(std::size_t a, std::size_t b) {
 	return a;
 }
 
-std::size_t MapTileInfo::hash() {
+std::size_t MapTileInfo::hash() const {
 	std::hash<uint32_t> uint32_hash;
+	std::hash<uint16_t> uint16_hash;
+	std::hash<int16_t> int16_hash;
 	std::hash<uint8_t> uint8_hash;
 	std::hash<int8_t> int8_hash;
 	std::hash<std::string> str_hash;
 	std::hash<bool> bool_hash;
 
-	std::size_t hash = str_hash(this->key);
-	hash = hash_combine(hash, str_hash(this->name));
-	hash = hash_combine(hash, str_hash(this->message));
+	std::size_t hash = str_hash(this->meta->key);
+	hash = hash_combine(hash, str_hash(this->meta->name));
+	hash = hash_combine(hash, str_hash(this->meta->message));
 	hash = hash_combine(hash, uint32_hash(this->autotile_class));
-	hash = hash_combine(hash, this->pic.hash());
+	hash = hash_combine(hash, uint16_hash(this->sheet)); // Each sheet key only ever gets one handle
+	hash = hash_combine(hash, int16_hash(this->pic_x));
+	hash = hash_combine(hash, int16_hash(this->pic_y));
 	hash = hash_combine(hash, bool_hash(this->over));
 	hash = hash_combine(hash, uint8_hash(this->autotile_layout));
 	hash = hash_combine(hash, uint8_hash(this->walls));
@@ -132,14 +190,14 @@ std::size_t MapTileInfo::hash() {
 	return hash;
 }
 
-std::size_t Pic::hash() {
-	std::hash<int> int_hash;
-	std::hash<std::string> str_hash;
-
-	std::size_t hash = str_hash(this->key);
-	hash = hash_combine(hash, int_hash(this->x));
-	hash = hash_combine(hash, int_hash(this->y));
-	return hash;
+// Everything hash() looks at; autotile_name comes from the name, so it doesn't need checking separately
+bool MapTileInfo::same_definition(const MapTileInfo *other) const {
+	return this->meta->key == other->meta->key && this->meta->name == other->meta->name && this->meta->message == other->meta->message
+		&& this->autotile_class == other->autotile_class && this->autotile_layout == other->autotile_layout
+		&& this->sheet == other->sheet && this->pic_x == other->pic_x && this->pic_y == other->pic_y
+		&& this->over == other->over && this->walls == other->walls && this->obj == other->obj && this->type == other->type
+		&& this->animation_frames == other->animation_frames && this->animation_speed == other->animation_speed
+		&& this->animation_mode == other->animation_mode && this->animation_offset == other->animation_offset;
 }
 
 // --------------------------------------------------------
@@ -157,12 +215,7 @@ MapCell::MapCell(struct MapTileReference turf) {
 // '-------------------------------------------------------
 
 Entity *TilemapTownClient::your_entity() {
-	if(this->your_id.empty())
-		return nullptr;
-	auto it = this->who.find(this->your_id);
-	if(it == this->who.end())
-		return nullptr;
-	return &(*it).second;
+	return this->entities.get(this->your_handle);
 }
 
 void TilemapTownClient::update_camera(float offset_x, float offset_y) {
@@ -187,19 +240,109 @@ void TilemapTownClient::turn_player(int direction) {
 	if(!you)
 		return;
 	you->update_direction(direction);
+	this->queue_turn(direction);
+}
+
+static void show_signs(TilemapTownClient *client, MapCell *cell) {
+	MapTileInfo *turf = cell->turf.get(client);
+	if(turf && turf->type == MAP_TILE_SIGN) {
+		MapTileMeta *meta = turf->meta.get();
+		printf("\x1b[35m%s says: %s\x1b[0m\n", (meta->name=="sign" || meta->name.empty()) ? "The sign" : meta->name.c_str(), meta->message.c_str());
+	}
+	for(auto & obj_reference : cell->objs) {
+		MapTileInfo *obj = obj_reference.get(client);
+		if(obj && obj->type == MAP_TILE_SIGN) {
+			MapTileMeta *meta = obj->meta.get();
+			printf("\x1b[35m%s says: %s\x1b[0m\n", (meta->name=="sign" || meta->name.empty()) ? "The sign" : meta->name.c_str(), meta->message.c_str());
+		}
+	}
+}
+
+// Works out where a step from (from_x, from_y) ends up, without changing anything
+StepResult TilemapTownClient::try_step(int from_x, int from_y, int offset_x, int offset_y, int direction) {
+	StepResult result = StepResult();
+	result.x = from_x;
+	result.y = from_y;
+	if(from_x < 0 || from_y < 0 || from_x >= this->town_map.width || from_y >= this->town_map.height) {
+		result.bumped = true;
+		result.bump_x = from_x;
+		result.bump_y = from_y;
+		return result;
+	}
+
+	int new_x = from_x + offset_x;
+	int new_y = from_y + offset_y;
+	if(new_x < 0 || new_y < 0 || new_x >= this->town_map.width || new_y >= this->town_map.height) {
+		result.bumped = true;
+		result.bump_x = new_x;
+		result.bump_y = new_y;
+		return result;
+	}
+
+	////////////////////////////
+	// Check old tile for walls
+	////////////////////////////
+	bool blocked = this->town_map.collision[from_y * this->town_map.width + from_x].walls & (1 << direction);
+	if(blocked && !this->walk_through_walls) {
+		result.bumped = true;
+		result.bump_x = from_x;
+		result.bump_y = from_y;
+		return result;
+	}
+
+	////////////////////////////
+	// Check new tile for walls
+	////////////////////////////
+	int dense_wall_bit = 1 << ((direction + 4) & 7); // For the new cell, the direction to check is rotated 180 degrees
+	int new_index = new_y * this->town_map.width + new_x;
+	result.entered_cell = &this->town_map.cells[new_index];
+	result.entered_sign = this->town_map.collision[new_index].sign;
+
+	blocked = this->town_map.collision[new_index].walls & dense_wall_bit;
+	if(blocked && !this->walk_through_walls) {
+		result.bumped = true;
+		result.bump_x = new_x;
+		result.bump_y = new_y;
+		return result;
+	}
+
+	result.x = new_x;
+	result.y = new_y;
+	return result;
+}
+
+// Has to be called after anything changes a cell's turf or objects
+void TilemapTownClient::update_cell_collision(size_t index) {
+	MapCell *cell = &this->town_map.cells[index];
+	CellCollision collision = CellCollision();
+	MapTileInfo *turf = cell->turf.get(this);
+	if(turf) {
+		collision.walls = turf->walls;
+		collision.sign = turf->type == MAP_TILE_SIGN;
+	}
+	for(auto & obj_reference : cell->objs) {
+		MapTileInfo *obj = obj_reference.get(this);
+		if(!obj)
+			continue;
+		collision.walls |= obj->walls;
+		if(obj->type == MAP_TILE_SIGN)
+			collision.sign = true;
+	}
+	if(this->town_map.collision[index].walls != collision.walls && this->walk_path_position < this->walk_path.size())
+		this->walk_path_stale = true;
+	this->town_map.collision[index] = collision;
+}
 
-	cJSON *json = cJSON_CreateObject();
-	cJSON_AddNumberToObject(json, "dir", (double)direction);
-	this->websocket_write("MOV", json);
-	cJSON_Delete(json);
+// For when tile definitions change, since cells refer to tiles by name
+void TilemapTownClient::rebuild_collision() {
+	for(size_t i=0; i<this->town_map.cells.size(); i++)
+		this->update_cell_collision(i);
 }
 
 void TilemapTownClient::move_player(int offset_x, int offset_y) {
 	Entity *you = this->your_entity();
 	if(!you)
 		return;
-	int original_x = you->x;
-	int original_y = you->y;
 
 	// Figure out the direction from the offset
 	int new_direction = 0;
@@ -222,128 +365,455 @@ void TilemapTownClient::move_player(int offset_x, int offset_y) {
 	}
 	you->update_direction(new_direction);
 
-	bool bumped = false;
-	int bumped_x, bumped_y;
-
-	int new_x = original_x + offset_x;
-	if(new_x < 0)
-		new_x = 0;    
-	if(new_x >= this->town_map.width)
-		new_x = this->town_map.width-1;
-
-	int new_y = original_y + offset_y;
-	if(new_y < 0)
-		new_y = 0;
-	if(new_y >= this->town_map.height)
-		new_y = this->town_map.height-1;
-	if((new_x != original_x + offset_x) || (new_y != original_y + offset_y)) {
-		bumped = true;
-		bumped_x = original_x + offset_x;
-		bumped_y = original_y + offset_y;
+	StepResult step = this->try_step(you->x, you->y, offset_x, offset_y, new_direction);
+	if(step.entered_sign)
+		show_signs(this, step.entered_cell);
+
+	//////////////////////////////////////
+	// Tell the server about the movement
+	//////////////////////////////////////
+	// This gets merged with any other movement made before the next network tick
+	if(!step.bumped) {
+		this->predict_step(&step, you->x, you->y, offset_x, offset_y, new_direction);
+		you->x = step.x;
+		you->y = step.y;
+		this->entity_grid.update(you);
+	} else {
+		this->queue_bump(step.bump_x, step.bump_y, new_direction);
 	}
 
-	you->x = new_x;
-	you->y = new_y;
+	you->walk_until = get_time_us() + WALK_ANIMATION_US;
+}
 
-	////////////////////////////
-	// Check old tile for walls
-	////////////////////////////
-	MapCell *cell = &this->town_map.cells[original_y * this->town_map.width + original_x];
+// .-------------------------------------------------------
+// | Movement prediction
+// '-------------------------------------------------------
 
-	MapTileInfo *turf = cell->turf.get(this);
-	if(turf && (turf->walls & (1 << new_direction)) && !this->walk_through_walls) {
-		// Go back
-		bumped = true;
-		bumped_x = original_x;
-		bumped_y = original_y;
-		you->x = original_x;
-		you->y = original_y;
+// Steps happen right away on the client, and get remembered until the server echoes them back.
+// If the server says you're somewhere the predictions don't account for, you get put there
+// and any steps that haven't gone out yet are redone from that position.
+
+#define MAX_PREDICTED_MOVES 64
+
+void TilemapTownClient::predict_step(const StepResult *step, int from_x, int from_y, int offset_x, int offset_y, int direction) {
+	if(this->predicted_moves.size() >= MAX_PREDICTED_MOVES) {
+		// Server doesn't seem to echo movement, so stop waiting for the oldest one
+		this->predicted_moves.pop_front();
+		this->prediction_stats.dropped++;
+	}
+	PredictedMove move = PredictedMove();
+	move.sequence = this->next_move_sequence++;
+	move.from_x = from_x;
+	move.from_y = from_y;
+	move.to_x = step->x;
+	move.to_y = step->y;
+	move.offset_x = offset_x;
+	move.offset_y = offset_y;
+	move.direction = direction;
+	this->predicted_moves.push_back(move);
+	this->queue_step(from_x, from_y, step->x, step->y, direction);
+}
+
+// Called when pending_move is written out, which covers every step that hasn't been sent yet
+void TilemapTownClient::mark_predictions_sent() {
+	uint64_t now = get_time_us();
+	PredictedMove *last = nullptr;
+	for(auto it = this->predicted_moves.rbegin(); it != this->predicted_moves.rend() && !it->sent; it++) {
+		it->sent = true;
+		it->sent_at = now;
+		if(!last)
+			last = &*it;
 	}
+	if(last)
+		last->last_in_message = true;
+}
 
-	for(auto & obj_reference : cell->objs) {
-		MapTileInfo *obj = obj_reference.get(this);
-		if(!obj)
+// The server says you're at (x, y). Echo is true if it's the server repeating a MOV you sent.
+// Returns true if that was expected, false if your position had to be corrected.
+bool TilemapTownClient::reconcile_position(int x, int y, bool echo) {
+	Entity *you = this->your_entity();
+	if(!you)
+		return true;
+
+	if(echo) {
+		auto &moves = this->predicted_moves;
+		for(auto it = moves.begin(); it != moves.end(); it++) {
+			if(!it->sent || !it->last_in_message || it->to_x != x || it->to_y != y)
+				continue;
+			if(this->measure_round_trips)
+				this->mov_round_trips_us.push_back(get_time_us() - it->sent_at);
+			// Anything older was either merged into this one or is never going to be echoed
+			this->prediction_stats.confirmed++;
+			moves.erase(moves.begin(), it+1);
+			this->confirmed_x = x;
+			this->confirmed_y = y;
+			return true;
+		}
+		// A late duplicate of something already confirmed
+		if(x == this->confirmed_x && y == this->confirmed_y && !moves.empty())
+			return true;
+	}
+	if(this->predicted_moves.empty() && you->x == x && you->y == y) {
+		this->confirmed_x = x;
+		this->confirmed_y = y;
+		return true;
+	}
+
+	// Roll back to where the server has you. Sent steps are the server's to judge now,
+	// so only the ones still in pending_move get replayed.
+	this->prediction_stats.corrected++;
+	this->confirmed_x = x;
+	this->confirmed_y = y;
+	you->x = x;
+	you->y = y;
+
+	std::vector<PredictedMove> unsent;
+	for(PredictedMove &move : this->predicted_moves)
+		if(!move.sent)
+			unsent.push_back(move);
+	this->predicted_moves.clear();
+	if(unsent.empty()) {
+		this->entity_grid.update(you);
+		return false;
+	}
+
+	int direction = this->pending_move.direction;
+	this->pending_move.active = false;
+	bool replayed_any = false;
+	for(PredictedMove &move : unsent) {
+		StepResult step = this->try_step(you->x, you->y, move.offset_x, move.offset_y, move.direction);
+		if(step.bumped)
 			continue;
-		if((obj->walls & (1 << new_direction)) && !this->walk_through_walls) {
-			if(!bumped) {
-				bumped = true;
-				bumped_x = original_x;
-				bumped_y = original_y;
+		this->predict_step(&step, you->x, you->y, move.offset_x, move.offset_y, move.direction);
+		you->x = step.x;
+		you->y = step.y;
+		this->prediction_stats.replayed++;
+		replayed_any = true;
+	}
+	// Keep the direction you were facing, even if none of the steps work anymore
+	if(replayed_any)
+		this->pending_move.direction = direction;
+	else
+		this->queue_turn(direction);
+	this->entity_grid.update(you);
+	return false;
+}
+
+// The server placed you somewhere new, like on a map change, so nothing predicted applies anymore
+void TilemapTownClient::reset_prediction() {
+	this->predicted_moves.clear();
+	Entity *you = this->your_entity();
+	if(you) {
+		this->confirmed_x = you->x;
+		this->confirmed_y = you->y;
+	}
+}
+
+// .-------------------------------------------------------
+// | Remote entity interpolation
+// '-------------------------------------------------------
+
+// Other entities are drawn interpolation.delay_us behind real time, between the positions their
+// MOVs put them at. The delay is about one step plus a few times the measured jitter, so there's
+// usually a newer position to head towards even when a MOV shows up late.
+
+#define MIN_INTERPOLATION_DELAY_US 50000
+#define MAX_INTERPOLATION_DELAY_US 500000
+#define DEFAULT_STEP_INTERVAL_US   150000
+#define MAX_STEP_INTERVAL_US       1000000 // Longer gaps than this are the entity stopping, not jitter
+#define MAX_STEP_DURATION_US       250000  // Longest a single step's motion gets stretched out to
+
+void TilemapTownClient::remote_entity_moved(Entity *entity, int x, int y) {
+	InterpolationStats *stats = &this->interpolation;
+	uint64_t now = get_time_us();
+	if(!stats->step_interval_us)
+		stats->step_interval_us = DEFAULT_STEP_INTERVAL_US;
+
+	// Estimate jitter the way RFC 3550 does, but against the entity's usual time between steps,
+	// because MOV doesn't say when it was sent. Each entity is compared against its own pace so that
+	// a fast walker next to a slow one doesn't look like jitter.
+	if(entity->last_step_at) {
+		float interval = now - entity->last_step_at;
+		if(interval < MAX_STEP_INTERVAL_US) {
+			if(entity->step_interval_us) {
+				float deviation = fabs(interval - entity->step_interval_us);
+				stats->jitter_us += (deviation - stats->jitter_us) / 16;
+				entity->step_interval_us += (interval - entity->step_interval_us) / 16;
+			} else {
+				entity->step_interval_us = interval;
 			}
-			// Go back
-			you->x = original_x;
-			you->y = original_y;
+			stats->step_interval_us += (interval - stats->step_interval_us) / 16;
 		}
 	}
+	entity->last_step_at = now;
+
+	float delay = stats->step_interval_us + stats->jitter_us * 3;
+	if(delay < MIN_INTERPOLATION_DELAY_US)
+		delay = MIN_INTERPOLATION_DELAY_US;
+	if(delay > MAX_INTERPOLATION_DELAY_US)
+		delay = MAX_INTERPOLATION_DELAY_US;
+	stats->delay_us = delay;
+
+	if(abs(x - entity->x) > 1 || abs(y - entity->y) > 1) {
+		// Teleports and long jumps just happen
+		stats->teleports++;
+		entity->clear_snapshots();
+		return;
+	}
+	stats->steps++;
+
+	// Start from where it is now. If it's been standing still instead of walking steadily,
+	// only start moving a step's time ago so the step isn't stretched out over the whole wait
+	float step_interval = entity->step_interval_us ? entity->step_interval_us : stats->step_interval_us;
+	uint64_t duration = step_interval < MAX_STEP_DURATION_US ? step_interval : MAX_STEP_DURATION_US;
+	uint64_t previous_time = 0;
+	if(entity->snapshot_count)
+		previous_time = entity->snapshots[(entity->snapshot_start + entity->snapshot_count - 1) % ENTITY_SNAPSHOTS].time;
+	if(!entity->snapshot_count || now - previous_time > duration + (uint64_t)(stats->jitter_us * 2))
+		entity->add_snapshot(now - duration, entity->x, entity->y);
+	entity->add_snapshot(now, x, y);
+}
 
-	////////////////////////////
-	// Check new tile for walls
-	////////////////////////////
-	if (!bumped) {
-		int dense_wall_bit = 1 << ((new_direction + 4) & 7); // For the new cell, the direction to check is rotated 180 degrees
-		cell = &this->town_map.cells[new_y * this->town_map.width + new_x];
+void Entity::add_snapshot(uint64_t time, int x, int y) {
+	if(this->snapshot_count == ENTITY_SNAPSHOTS) {
+		this->snapshot_start = (this->snapshot_start + 1) % ENTITY_SNAPSHOTS;
+		this->snapshot_count--;
+	}
+	this->snapshots[(this->snapshot_start + this->snapshot_count) % ENTITY_SNAPSHOTS] = {time, x, y};
+	this->snapshot_count++;
+}
 
-		turf = cell->turf.get(this);
-		if(turf && turf->type == MAP_TILE_SIGN) {
-			printf("\x1b[35m%s says: %s\x1b[0m\n", (turf->name=="sign" || turf->name.empty()) ? "The sign" : turf->name.c_str(), turf->message.c_str());
-		}
-		if(turf && (turf->walls & dense_wall_bit) && !this->walk_through_walls) {
-			// Go back
-			bumped = true;
-			bumped_x = you->x;
-			bumped_y = you->y;
-			you->x = original_x;
-			you->y = original_y;
-		}
+void Entity::clear_snapshots() {
+	this->snapshot_start = 0;
+	this->snapshot_count = 0;
+}
+
+// Position in pixels to draw the entity at, as of render_time
+void Entity::get_draw_position(uint64_t render_time, float *draw_x, float *draw_y) {
+	// Snapshots that are completely in the past aren't needed anymore
+	while(this->snapshot_count >= 2 && this->snapshots[(this->snapshot_start + 1) % ENTITY_SNAPSHOTS].time <= render_time) {
+		this->snapshot_start = (this->snapshot_start + 1) % ENTITY_SNAPSHOTS;
+		this->snapshot_count--;
+	}
+	if(this->snapshot_count < 2) {
+		// Caught up to the newest position
+		this->snapshot_count = 0;
+		*draw_x = this->x * 16;
+		*draw_y = this->y * 16;
+		return;
+	}
+
+	EntitySnapshot *from = &this->snapshots[this->snapshot_start];
+	EntitySnapshot *to   = &this->snapshots[(this->snapshot_start + 1) % ENTITY_SNAPSHOTS];
+	float amount = 0;
+	if(render_time > from->time && to->time > from->time)
+		amount = (float)(render_time - from->time) / (to->time - from->time);
+	*draw_x = (from->x + (to->x - from->x) * amount) * 16;
+	*draw_y = (from->y + (to->y - from->y) * amount) * 16;
+}
+
+// .-------------------------------------------------------
+// | Entity grid
+// '-------------------------------------------------------
+
+static bool entity_is_above(const Entity *a, const Entity *b) {
+	return a->y < b->y;
+}
 
-		for(auto & obj_reference : cell->objs) {
-			MapTileInfo *obj = obj_reference.get(this);
-			if(!obj)
+void EntityGrid::reset(int map_width, int map_height) {
+	this->width  = std::max(1, (map_width  + ENTITY_GRID_CELL_SIZE - 1) / ENTITY_GRID_CELL_SIZE);
+	this->height = std::max(1, (map_height + ENTITY_GRID_CELL_SIZE - 1) / ENTITY_GRID_CELL_SIZE);
+	this->cells.clear();
+	this->cells.resize(this->width * this->height);
+}
+
+// Puts the entity in the right cell for its position, and in the right place in that cell's list
+void EntityGrid::update(Entity *entity) {
+	if(this->cells.empty())
+		this->reset(0, 0);
+	// Anything outside the map goes in the nearest cell
+	int cell_x = std::clamp(entity->x / ENTITY_GRID_CELL_SIZE, 0, this->width - 1);
+	int cell_y = std::clamp(entity->y / ENTITY_GRID_CELL_SIZE, 0, this->height - 1);
+	int index = cell_y * this->width + cell_x;
+
+	this->remove(entity);
+	std::vector<Entity*> &cell = this->cells[index];
+	cell.insert(std::upper_bound(cell.begin(), cell.end(), entity, entity_is_above), entity);
+	entity->in_grid = true;
+	entity->grid_cell = index;
+}
+
+void EntityGrid::remove(Entity *entity) {
+	if(!entity->in_grid)
+		return;
+	std::vector<Entity*> &cell = this->cells[entity->grid_cell];
+	auto it = std::find(cell.begin(), cell.end(), entity);
+	if(it != cell.end())
+		cell.erase(it);
+	entity->in_grid = false;
+}
+
+// Fills out with the entities in the cells touching the rectangle (in tiles), sorted by y
+void EntityGrid::query(int x1, int y1, int x2, int y2, std::vector<Entity*> &out) {
+	out.clear();
+	if(this->cells.empty())
+		return;
+	int cell_x1 = std::clamp(x1 / ENTITY_GRID_CELL_SIZE, 0, this->width - 1);
+	int cell_y1 = std::clamp(y1 / ENTITY_GRID_CELL_SIZE, 0, this->height - 1);
+	int cell_x2 = std::clamp(x2 / ENTITY_GRID_CELL_SIZE, 0, this->width - 1);
+	int cell_y2 = std::clamp(y2 / ENTITY_GRID_CELL_SIZE, 0, this->height - 1);
+
+	for(int cell_y = cell_y1; cell_y <= cell_y2; cell_y++) {
+		// Rows of cells don't overlap, so only each row's cells need merging together
+		size_t row_start = out.size();
+		for(int cell_x = cell_x1; cell_x <= cell_x2; cell_x++) {
+			std::vector<Entity*> &cell = this->cells[cell_y * this->width + cell_x];
+			if(cell.empty())
 				continue;
-			if(obj->type == MAP_TILE_SIGN) {
-				printf("\x1b[35m%s says: %s\x1b[0m\n", (obj->name=="sign" || obj->name.empty()) ? "The sign" : obj->name.c_str(), obj->message.c_str());
-			}
-			if((obj->walls & dense_wall_bit) && !this->walk_through_walls) {
-				if(!bumped) {
-					bumped = true;
-					bumped_x = you->x;
-					bumped_y = you->y;
-				}
-				// Go back
-				you->x = original_x;
-				you->y = original_y;
-			}
+			size_t cell_start = out.size();
+			out.insert(out.end(), cell.begin(), cell.end());
+			if(cell_start != row_start)
+				std::inplace_merge(out.begin() + row_start, out.begin() + cell_start, out.end(), entity_is_above);
 		}
 	}
+}
 
-	//////////////////////////////////////
-	// Tell the server about the movement
-	//////////////////////////////////////
-	cJSON *json = cJSON_CreateObject();
-	if(!bumped) {
-		int from_array[2] = {original_x, original_y};
-		cJSON *json_from = cJSON_CreateIntArray(from_array, 2);
-		cJSON_AddItemToObject(json, "from", json_from);
-
-		int to_array[2] = {you->x, you->y};
-		cJSON *json_to = cJSON_CreateIntArray(to_array, 2);
-		cJSON_AddItemToObject(json, "to", json_to);
+void TilemapTownClient::rebuild_entity_grid() {
+	this->entity_grid.reset(this->town_map.width, this->town_map.height);
+	for(EntitySlot &slot : this->entities.slots) {
+		if(!slot.present)
+			continue;
+		slot.entity.in_grid = false;
+		this->entity_grid.update(&slot.entity);
+	}
+}
+
+// .-------------------------------------------------------
+// | Entity table
+// '-------------------------------------------------------
+
+EntityHandle EntityTable::find(std::string_view id) {
+	auto it = this->handle_for_id.find(id);
+	if(it == this->handle_for_id.end())
+		return 0;
+	return (*it).second;
+}
+
+EntityHandle EntityTable::intern(std::string_view id) {
+	if(id.empty())
+		return 0;
+	EntityHandle handle = this->find(id);
+	if(handle)
+		return handle;
+
+	uint32_t index;
+	if(!this->free_slots.empty()) {
+		index = this->free_slots.back();
+		this->free_slots.pop_back();
 	} else {
-		int bump_array[2] = {bumped_x, bumped_y};
-		cJSON *json_bump = cJSON_CreateIntArray(bump_array, 2);
-		cJSON_AddItemToObject(json, "bump", json_bump);
+		index = this->slots.size();
+		if(index > ENTITY_HANDLE_INDEX_MASK)
+			return 0;
+		this->slots.emplace_back();
+		this->slots.back().generation = 1;
+	}
+	EntitySlot *slot = &this->slots[index];
+	slot->id = std::string(id);
+	slot->in_use = true;
+	slot->present = false;
+	handle = this->handle_at(index);
+	this->handle_for_id[slot->id] = handle;
+	return handle;
+}
 
-		// Tell server what map the bump is intended for
-		if(this->town_map.id != 0) {
-			cJSON_AddNumberToObject(json, "if_map", this->town_map.id);
-		}
+EntityHandle EntityTable::handle_at(uint32_t index) {
+	return index | (this->slots[index].generation << ENTITY_HANDLE_INDEX_BITS);
+}
+
+EntitySlot *EntityTable::get_slot(EntityHandle handle) {
+	uint32_t index = handle & ENTITY_HANDLE_INDEX_MASK;
+	if(!handle || index >= this->slots.size())
+		return nullptr;
+	EntitySlot *slot = &this->slots[index];
+	if(!slot->in_use || slot->generation != handle >> ENTITY_HANDLE_INDEX_BITS)
+		return nullptr;
+	return slot;
+}
+
+Entity *EntityTable::get(EntityHandle handle) {
+	EntitySlot *slot = this->get_slot(handle);
+	if(!slot || !slot->present)
+		return nullptr;
+	return &slot->entity;
+}
+
+Entity *EntityTable::add(EntityHandle handle) {
+	EntitySlot *slot = this->get_slot(handle);
+	if(!slot)
+		return nullptr;
+	if(!slot->present)
+		this->count++;
+	slot->present = true;
+	slot->entity = Entity();
+	return &slot->entity;
+}
+
+void EntityTable::remove(EntityHandle handle) {
+	EntitySlot *slot = this->get_slot(handle);
+	if(!slot)
+		return;
+	if(slot->present)
+		this->count--;
+	this->handle_for_id.erase(slot->id);
+	slot->entity = Entity();
+	slot->id.clear();
+	slot->in_use = false;
+	slot->present = false;
+	// Any handles still pointing here stop working
+	slot->generation = (slot->generation + 1) & ENTITY_HANDLE_GENERATION_MASK;
+	if(!slot->generation)
+		slot->generation = 1;
+	this->free_slots.push_back(handle & ENTITY_HANDLE_INDEX_MASK);
+}
+
+// For an entity that's gone while something still links to it. The ID and handle stay,
+// so if it's added again the vehicle and passenger links find it.
+void EntityTable::remove_keeping_id(EntityHandle handle) {
+	EntitySlot *slot = this->get_slot(handle);
+	if(!slot)
+		return;
+	if(slot->present)
+		this->count--;
+	slot->entity = Entity();
+	slot->present = false;
+}
+
+bool EntityTable::is_linked(EntityHandle handle) {
+	if(!handle)
+		return false;
+	for(EntitySlot &slot : this->slots) {
+		if(!slot.present)
+			continue;
+		if(slot.entity.vehicle == handle || std::find(slot.entity.passengers.begin(), slot.entity.passengers.end(), handle) != slot.entity.passengers.end())
+			return true;
 	}
-	cJSON_AddNumberToObject(json, "dir", (double)new_direction);
+	return false;
+}
 
-	this->websocket_write("MOV", json);
-	cJSON_Delete(json);
+void EntityTable::rename(EntityHandle handle, std::string_view new_id) {
+	EntitySlot *slot = this->get_slot(handle);
+	if(!slot || new_id.empty())
+		return;
+	this->handle_for_id.erase(slot->id);
+	slot->id = std::string(new_id);
+	this->handle_for_id[slot->id] = handle;
+}
 
-	you->walk_timer = 30+1; // 30*(16.6666ms/1000) = 0.5
+void EntityTable::clear() {
+	for(size_t i=0; i<this->slots.size(); i++) {
+		if(this->slots[i].in_use)
+			this->remove(this->handle_at(i));
+	}
 }
 
 void Entity::update_direction(int direction) {
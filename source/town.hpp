@@ -17,13 +17,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <deque>
 #include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
-#include <variant>
 
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -45,6 +47,13 @@
 #define VIEW_WIDTH_TILES 25
 #define VIEW_HEIGHT_TILES 15
 
+#define OUTBOUND_BYTES_PER_TICK 4096
+#define TILE_SHEET_REQUEST_TIMEOUT_US 10000000 // An IMG request with no reply by then is given up on, and can be asked for again
+
+#define WALK_ANIMATION_US 500000 // How long an entity shows its walking frames after a step
+
+#define protocol_command_as_int(a,b,c) ((a) | ((b)<<8) | ((c)<<16))
+
 #ifdef __3DS__
 #include <3ds.h>
 #include <citro2d.h>
@@ -52,6 +61,8 @@
 
 class TilemapTownClient;
 
+uint64_t get_time_us();
+
 struct http_file {
 	uint8_t *memory;
 	size_t size;
@@ -70,13 +81,12 @@ struct http_transfer {
 struct MapTileInfo;
 
 struct MapTileReference {
-	std::variant<std::monostate, std::string, std::shared_ptr<MapTileInfo>> tile;
+	std::shared_ptr<MapTileInfo> tile; // Might be a placeholder, see TilemapTownClient::get_tile_by_key
 
 	MapTileInfo* get(TilemapTownClient *client);
 
 	MapTileReference();
 	MapTileReference(struct cJSON *json, TilemapTownClient *client);
-	MapTileReference(std::string str);
 	MapTileReference(std::string str, TilemapTownClient *client);
 	MapTileReference(MapTileInfo *tile, TilemapTownClient *client);
 	MapTileReference(std::shared_ptr<MapTileInfo> tile);
@@ -90,10 +100,18 @@ struct MapCell {
 	MapCell(struct MapTileReference turf);
 };
 
+// Walls and signs in a cell, worked out from its turf and objects whenever the cell changes,
+// so that checking a step doesn't have to look up any tiles
+struct CellCollision {
+	uint8_t walls; // Every tile's walls bits ORed together
+	bool sign;     // Has a turf or object that's a sign
+};
+
 class TownMap {
 public:
 	int width, height;
 	std::vector<MapCell> cells;
+	std::vector<CellCollision> collision; // Same layout as cells
 
 	// Metadata
 	int id;
@@ -101,6 +119,29 @@ public:
 	void init_map(int width, int height);
 };
 
+#ifdef __3DS__
+// Subtextures for every 16x16 tile, 8x8 quadrant and 32x32 entity frame in a texture of a given size, worked out
+// when a PNG is decoded so that drawing only has to look them up. Every texture that's the same size shares one.
+struct SubTextureTable {
+	int width, height; // Of the texture
+	std::vector<Tex3DS_SubTexture> tiles;     // Row by row
+	std::vector<Tex3DS_SubTexture> quadrants;
+	std::vector<Tex3DS_SubTexture> frames;
+
+	// These return nullptr for anything outside of the texture
+	const Tex3DS_SubTexture *tile(int x, int y) const;
+	const Tex3DS_SubTexture *quadrant(int x, int y) const;
+	const Tex3DS_SubTexture *frame(int x, int y) const;
+};
+#endif
+
+// How much of a 16x16 tile or 8x8 quadrant can be seen through, found when the image is decoded
+enum TileOpacity : uint8_t {
+	TILE_TRANSLUCENT, // Also used when it's not known
+	TILE_EMPTY,
+	TILE_OPAQUE,
+};
+
 struct LoadedTextureInfo {
 	int original_width;  // Width of the source image, rather than the texture
 	int original_height;
@@ -112,8 +153,15 @@ struct LoadedTextureInfo {
 	#define MULTI_TEXTURE_COLUMNS 4
 	#define MULTI_TEXTURE_ROWS 4
 	C3D_Tex* texture[MULTI_TEXTURE_COLUMNS][MULTI_TEXTURE_ROWS];
-
-	bool image_for_xy(C2D_Image *image, Tex3DS_SubTexture *subtexture, int tile_x, int tile_y, bool quadrant);
+	const SubTextureTable *subtextures[MULTI_TEXTURE_COLUMNS][MULTI_TEXTURE_ROWS];
+	int opacity_columns;                   // Width of the image in 16x16 tiles
+	std::vector<uint8_t> tile_opacity;     // TileOpacity for each 16x16 tile in the image, row by row
+	std::vector<uint8_t> quadrant_opacity; // Same for each 8x8 quadrant, with twice as many columns
+
+	void find_subtexture_tables();
+	void find_opacity(const u32 *pixels, int stride, int width, int height);
+	enum TileOpacity get_opacity(int tile_x, int tile_y, bool quadrant) const;
+	bool image_for_xy(C2D_Image *image, int tile_x, int tile_y, bool quadrant);
 	#endif
 };
 
@@ -122,19 +170,112 @@ struct Pic {
 	int x;
 	int y;
 
-	bool ready_to_draw; // Map tile has the texture loaded in
+	bool ready_to_draw; // Texture is loaded in
 
 	#ifdef __3DS__
-	Tex3DS_SubTexture subtexture;
 	C2D_Image image;               // Texture and subtexture
 	LoadedTextureInfo *extra_info; // Can use this to get the original size, or the other textures this PNG was turned into
+	const SubTextureTable *subtextures; // For image's texture
 
 	C2D_Image *get(TilemapTownClient *client);
 	LoadedTextureInfo *get_texture(TilemapTownClient *client);
 	#endif
+};
+
+#ifdef __3DS__
+// What draw_map collects everything into before drawing it, from the bottom up
+enum DrawLayer {
+	DRAW_LAYER_TURF,
+	DRAW_LAYER_OBJS,
+	DRAW_LAYER_ENTITIES,
+	DRAW_LAYER_OVER,
+	DRAW_LAYER_COUNT,
+};
+
+// A quad for draw_map to draw. Quads in the same layer with the same depth never overlap, so they can be drawn
+// in any order, which lets the ones that use the same texture be put together; citro2d has to flush whenever
+// the texture changes. Depth is the place in a cell's list of objects, or in the order entities are drawn in.
+struct TileQuad {
+	C3D_Tex *texture;
+	const Tex3DS_SubTexture *subtexture;
+	float x, y;
+	uint32_t depth;
+};
+
+struct DrawStats {
+	unsigned int quads;            // In the last frame
+	unsigned int texture_switches;
+	unsigned int dropped;          // Didn't fit in citro2d's buffer
+	unsigned int empty_quads;      // Skipped because every pixel was transparent
+	unsigned int hidden_tiles;     // Skipped because an opaque object in the same cell was on top
+	unsigned int budget_increases;
+};
+
+class TileDrawList {
+public:
+	std::vector<TileQuad> layers[DRAW_LAYER_COUNT];
+	enum DrawLayer layer; // Where quads go as they're added
+	uint32_t depth;
+	unsigned int empty_quads;  // Counted while adding, and handed over to DrawStats by draw()
+	unsigned int hidden_tiles;
+
+	void add(const C2D_Image &image, float x, float y);
+	void draw(DrawStats *stats);
+};
+#endif
+
+// Decoded MOV and WHO fields, filled in either from cJSON or from the fast path scanner.
+// The string_views point into the message being handled, so these don't outlive it.
+struct MovUpdate {
+	std::string_view id;
+	char id_buffer[12];     // For numeric IDs that need to be turned into text
+	bool has_from;
+	bool has_to;
+	int to_x, to_y;
+	bool has_dir;
+	int dir;
+	bool has_offset;        // Present at all
+	bool offset_valid;      // Present and an [x, y] pair; otherwise the offset gets reset
+	int offset_x, offset_y;
+};
+
+struct EntityUpdate {
+	std::string_view id;
+	char id_buffer[12];
+	bool has_name;
+	std::string_view name;
+	bool has_pic;
+	std::string_view pic_sheet;
+	char pic_sheet_buffer[12];
+	int pic_x, pic_y;
+	bool has_x, has_y, has_dir;
+	int x, y, dir;
+	bool has_offset, offset_valid;
+	int offset_x, offset_y;
+	bool has_vehicle;
+	std::string_view vehicle;
+	bool has_is_following, is_following;
+	bool has_in_user_list, in_user_list;
+	bool has_typing, is_typing;
+	struct cJSON *passengers; // Only from cJSON, the fast path falls back if there are any
+};
 
-	std::size_t hash();
+// Where a remote entity was at a given time, for interpolating between
+struct EntitySnapshot {
+	uint64_t time;  // get_time_us() when the MOV arrived
+	int x, y;
 };
+#define ENTITY_SNAPSHOTS 8
+
+// Entities are referred to by these instead of by the server's IDs, which only get looked up when a message comes in.
+// The low bits are an index into EntityTable::slots and the rest is that slot's generation, so a handle to an entity
+// that's since been removed stops working instead of pointing at whatever reused the slot. 0 is never a valid handle.
+typedef uint32_t EntityHandle;
+#define ENTITY_HANDLE_INDEX_BITS 20
+#define ENTITY_HANDLE_INDEX_MASK ((1 << ENTITY_HANDLE_INDEX_BITS) - 1)
+#define ENTITY_HANDLE_GENERATION_MASK ((1 << (32 - ENTITY_HANDLE_INDEX_BITS)) - 1)
+
+class EntityTable;
 
 class Entity {
 public:
@@ -144,39 +285,94 @@ public:
 	int y;
 	bool in_user_list;
 
-	std::string vehicle_id;
-	std::unordered_set <std::string> passengers;
+	EntityHandle vehicle;
+	std::vector<EntityHandle> passengers;
 	bool is_following;
 
 	bool is_typing;
 
+	// Position in TilemapTownClient::entity_grid
+	bool in_grid;
+	int grid_cell;
+
 	// Animation
-	int walk_timer;
+	uint64_t walk_until; // get_time_us() when the walking animation stops
 	int direction;
 	int direction_4;
 	int direction_lr;
 	int offset_x;
 	int offset_y;
 
-	std::string apply_json(cJSON *json);
+	// Interpolation; x and y are always the newest position, and these are for drawing it smoothly
+	EntitySnapshot snapshots[ENTITY_SNAPSHOTS]; // Ring buffer, oldest first starting at snapshot_start
+	uint8_t snapshot_start;
+	uint8_t snapshot_count;
+	uint64_t last_step_at;
+	float step_interval_us; // Smoothed time between this entity's steps while it keeps walking, 0 until known
+
+	bool apply_update(const EntityUpdate *update, EntityTable *table);
 	void update_direction(int direction);
+	void add_snapshot(uint64_t time, int x, int y);
+	void clear_snapshots();
+	void get_draw_position(uint64_t render_time, float *draw_x, float *draw_y);
 };
 
-enum MapTileType {
+// Coarse grid of which entities are where, so drawing only has to look at the ones near the camera.
+// Each cell's list is kept sorted by y, so the visible ones come out in drawing order.
+#define ENTITY_GRID_CELL_SIZE 8 // In tiles
+
+class EntityGrid {
+public:
+	int width, height; // In cells
+	std::vector<std::vector<Entity*>> cells;
+
+	void reset(int map_width, int map_height);
+	void update(Entity *entity);
+	void remove(Entity *entity);
+	void query(int x1, int y1, int x2, int y2, std::vector<Entity*> &out);
+};
+
+enum MapTileType : uint8_t {
 	MAP_TILE_NONE,
 	MAP_TILE_SIGN,
 };
 
-struct MapTileInfo {
-	std::string key;  // Key used to look up this MapTileInfo
-	std::string name; // Name, for metadata
+// Tiles refer to their sheet by index into TilemapTownClient::tile_sheets, so there's one
+// place to keep track of a sheet's texture and drawing a tile doesn't go through a string
+typedef uint16_t TileSheetHandle; // 0 is no sheet
+
+struct TileSheet {
+	std::string key;     // URL or integer
+	bool ready_to_draw;  // Texture is loaded in
+
+	#ifdef __3DS__
+	LoadedTextureInfo *texture;
+	LoadedTextureInfo *get_texture(TilemapTownClient *client);
+	#endif
+};
+
+// Layouts the client doesn't know about get stored as AUTOTILE_LAYOUT_UNKNOWN,
+// so that the layout can pick out a drawing routine without any more checks
+#define AUTOTILE_LAYOUT_UNKNOWN 6
+#define AUTOTILE_LAYOUT_COUNT 7
+
+// The parts of a tile that are only needed once in a while, like when stepping on a sign
+struct MapTileMeta {
+	std::string key;     // Key used to look up this MapTileInfo
+	std::string name;    // Name, for metadata
 	std::string message; // For signs
-	uint32_t autotile_class;
+};
 
+// Drawing goes through several of these for every cell on the screen, so this only has what drawing
+// and movement need, and it's small enough to fit in a cache line. Everything else is in the MapTileMeta.
+struct MapTileInfo {
 	// Appearance
-	Pic pic;          // [sheet, x, y] format
+	TileSheetHandle sheet;
+	int16_t pic_x, pic_y;
 	bool over;        // Display on top of entities
-	uint8_t autotile_layout;
+	uint8_t autotile_layout; // Up to AUTOTILE_LAYOUT_UNKNOWN
+	uint32_t autotile_class;
+	uint32_t autotile_name; // CRC of the name, for autotiling with tiles that have no class
 
 	// Animation
 	uint8_t animation_frames, animation_speed, animation_mode;
@@ -187,7 +383,148 @@ struct MapTileInfo {
 	bool obj;
 	enum MapTileType type;
 
-	std::size_t hash();
+	bool pending;     // Placeholder for a tile that hasn't been defined yet
+
+	std::shared_ptr<MapTileMeta> meta; // Always set by map_tile_from_json, and shared between copies after that
+
+	std::size_t hash() const;
+	bool same_definition(const MapTileInfo *other) const;
+};
+
+// Custom tiles that are written into the map as JSON instead of being referred to by key.
+// Identical ones are interned so each only exists once; they're found by hash and then compared in full.
+struct CustomTileStats {
+	unsigned int references; // Custom tiles that came in
+	unsigned int created;    // How many of those weren't already interned
+	unsigned int swept;      // Entries removed after every reference to their tile went away
+	size_t bytes_saved;      // Roughly how much memory the reused ones would have taken
+};
+
+class CustomTileTable {
+public:
+	std::unordered_multimap<std::size_t, std::weak_ptr<MapTileInfo>> tiles;
+	size_t sweep_at;  // Sweep out dead entries when the table gets this big
+	CustomTileStats stats;
+
+	std::shared_ptr<MapTileInfo> intern(const MapTileInfo *tile, bool *created);
+	void sweep();
+	void clear();
+	size_t size();
+};
+
+// ------------------------------------
+
+struct PendingMove {
+	bool active;     // There's a MOV waiting to be sent on the next network tick
+	bool has_move;   // Includes "from" and "to"
+	bool has_bump;   // Includes "bump" and "if_map"
+	int from_x, from_y;
+	int to_x, to_y;
+	int bump_x, bump_y;
+	int bump_map;
+	int direction;
+
+	int format(char *buffer, size_t size);
+};
+
+enum OutboundLane {
+	LANE_MOVEMENT,
+	LANE_INTERACTION,
+	LANE_CHAT,
+	LANE_ASSETS,
+	LANE_COUNT,
+};
+
+struct OutboundMessage {
+	size_t position;    // Start of the message in its lane's buffer, counting bytes erased from the front
+	size_t length;
+	uint64_t queued_at; // get_time_us() when it was written
+};
+
+struct OutboundLaneQueue {
+	std::string buffer;   // Serialized messages, each one followed by a newline so a run of them is already a BAT body
+	size_t erased;        // Bytes that have been removed from the front of the buffer
+	size_t sent;          // Position up to which messages have been handed to wslay
+	int frames_in_flight; // The buffer can't be compacted while wslay may still read from it
+	size_t write_start;   // Where the message currently being written begins
+	std::deque<OutboundMessage> messages;
+};
+
+struct OutboundFrame {
+	int lane;
+	size_t position;      // Same coordinates as OutboundMessage::position
+	size_t length;
+	size_t read;          // How much wslay has taken so far, including the "BAT " prefix
+	bool batch;
+};
+
+struct OutboundLaneStats {
+	unsigned int messages;
+	unsigned int frames;   // Less than messages if some got sent together in one BAT
+	size_t bytes;
+	uint64_t total_latency_us;
+	uint64_t max_latency_us;
+};
+
+struct OutboundStats {
+	unsigned int mov_sent;       // MOV messages actually handed to wslay
+	unsigned int mov_coalesced;  // MOV messages that got merged into a later one instead of being sent
+	size_t mov_bytes_saved;      // Bytes that the merged messages would have taken up
+	size_t queue_depth;          // wslay's outgoing message count, as of the last network tick
+	size_t max_queue_depth;
+	unsigned int ticks_over_budget;  // Ticks where something had to wait for the next one
+	OutboundLaneStats lanes[LANE_COUNT];
+};
+
+// A step the client took without waiting for the server, kept until the server echoes it
+struct PredictedMove {
+	uint32_t sequence;
+	int from_x, from_y;
+	int to_x, to_y;
+	int offset_x, offset_y;  // The input, so it can be replayed from a different position
+	int direction;
+	bool sent;               // Otherwise it's still part of pending_move
+	bool last_in_message;    // Steps get merged into one MOV, and only the last one's "to" is echoed
+	uint64_t sent_at;
+};
+
+struct PredictionStats {
+	unsigned int confirmed;   // Echoes that matched a prediction
+	unsigned int corrected;   // Times the server put us somewhere else
+	unsigned int replayed;    // Unsent steps redone from the corrected position
+	unsigned int dropped;     // Steps that were never echoed
+};
+
+// Result of checking a step against the map
+struct StepResult {
+	bool bumped;
+	int x, y;                // Where you end up
+	int bump_x, bump_y;      // What got bumped into, if bumped
+	MapCell *entered_cell;   // Cell that was stepped or bumped into
+	bool entered_sign;       // entered_cell has a sign to show
+};
+
+// A* over TownMap::collision, for walking to a tile that was tapped on.
+// Everything is kept between searches so a search doesn't have to allocate or clear anything.
+#define PATH_STEP_US 150000 // Time between steps while walking a path, about the D-pad's key repeat
+#define PATH_SEARCH_LIMIT 8192 // Cells to look at before settling for the closest one so far; plenty for anywhere on screen
+
+struct PathNode {
+	uint32_t estimate; // Steps so far plus the distance left
+	uint32_t cost;     // Steps so far
+	uint32_t index;
+};
+
+class PathFinder {
+public:
+	std::vector<uint32_t> cost;     // Fewest steps found to each cell, if visited matches search
+	std::vector<uint32_t> visited;
+	std::vector<uint8_t> came_from; // Direction of the step into each cell
+	std::vector<PathNode> open;     // Heap, lowest estimate first
+	uint32_t search;
+	unsigned int expanded;          // Cells the last search looked at
+
+	bool find(const TownMap *map, int from_x, int from_y, int to_x, int to_y, std::vector<uint8_t> &directions);
 };
 
 // ------------------------------------
@@ -208,6 +545,71 @@ public:
 	void run_transfers();
 };
 
+struct string_hash {
+	// Lets unordered_maps with std::string keys be searched with a std::string_view
+	using is_transparent = void;
+	std::size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+};
+
+struct EntitySlot {
+	Entity entity;
+	std::string id;         // Server's ID for it
+	uint32_t generation;    // Goes up whenever the slot is freed
+	bool in_use;            // Has an ID, though the entity itself might not have been added yet
+	bool present;           // The server has told us about this entity
+	uint32_t listed;        // EntityTable::list_serial as of the last WHO list that included it
+	uint32_t linked;        // Same, for the last WHO list where a listed entity had it as a vehicle or passenger
+};
+
+class EntityTable {
+public:
+	std::deque<EntitySlot> slots; // A deque so that Entity pointers, like the ones in EntityGrid, stay valid when it grows
+	std::vector<uint32_t> free_slots;
+	std::unordered_map<std::string, EntityHandle, string_hash, std::equal_to<>> handle_for_id;
+	size_t count;                 // Entities that are present
+	uint32_t list_serial;         // Goes up with each WHO list, to find the entities that weren't in it
+
+	EntityHandle find(std::string_view id);   // 0 if the ID hasn't been seen
+	EntityHandle intern(std::string_view id); // Reserves a slot for IDs that haven't been seen, so they can be linked to early
+	EntityHandle handle_at(uint32_t index);
+	EntitySlot *get_slot(EntityHandle handle);
+	Entity *get(EntityHandle handle);         // Only if it's present
+	Entity *add(EntityHandle handle);         // Resets the entity and marks it present
+	void remove(EntityHandle handle);
+	void remove_keeping_id(EntityHandle handle); // Frees the entity but not the slot, so links to it keep working
+	bool is_linked(EntityHandle handle);         // Some present entity has it as a vehicle or passenger
+	void rename(EntityHandle handle, std::string_view new_id);
+	void clear();
+};
+
+// What entities use a given tile sheet, so an IMG update only has to touch those.
+// Tiles don't need this, since they all go through the TileSheet.
+struct SheetDependents {
+	std::vector<EntityHandle> entities;
+	size_t prune_at;  // Clear out entries that don't apply anymore when adding one would make it this big
+};
+
+struct InboundStats {
+	unsigned int fast_path;  // Messages handled without cJSON
+	unsigned int fallback;   // Messages the fast path gave up on
+};
+
+struct InterpolationStats {
+	float jitter_us;          // Smoothed variation in the time between one entity's steps, against its own usual pace
+	float step_interval_us;   // Smoothed time between steps across every entity, for the delay
+	uint32_t delay_us;        // How far behind remote entities get drawn
+	unsigned int steps;       // Steps that got interpolated
+	unsigned int teleports;   // Moves too far to interpolate, which just jump
+};
+
+struct CommandTiming {
+	unsigned int count;
+	unsigned int fast_path;
+	size_t bytes;
+	uint64_t parse_us;       // cJSON parsing
+	uint64_t apply_us;       // Handling the parsed message, or the whole fast path
+};
+
 class TilemapTownClient {
 public:
 	// Network
@@ -222,18 +624,39 @@ public:
     mbedtls_ssl_config conf;
     mbedtls_x509_crt cacert;
 	bool connected;
+	bool plain_websocket; // No TLS, for local test servers
 
 	// Game state
 	TownMap town_map;
 	std::unordered_map<std::string, std::shared_ptr<MapTileInfo>> tileset;
-	std::unordered_map<std::size_t, std::weak_ptr<MapTileInfo>> json_tileset; // Custom JSON tiles, referenced by hash
-	std::unordered_map<std::string, Entity> who;
+	CustomTileTable json_tileset; // Custom JSON tiles
+	std::unordered_map<std::string, std::shared_ptr<MapTileInfo>> pending_tiles; // Placeholders for keys the tileset doesn't have yet
+	EntityTable entities;
+	EntityGrid entity_grid;
+	std::vector<Entity*> entity_draw_list; // Reused every frame
 	#ifdef __3DS__
 	std::unordered_map<std::string, LoadedTextureInfo> texture_for_url;
+	TileDrawList draw_list; // Reused every frame
+	DrawStats draw_stats;
 	#endif
 
 	std::unordered_map<std::string, std::string> url_for_tile_sheet;
-	std::unordered_set<std::string> requested_tile_sheets;
+	std::unordered_map<std::string, uint64_t> requested_tile_sheets; // Key to when it was asked for, until there's a reply
+	std::vector<std::string> pending_image_requests;      // Keys to request on the next network tick
+	std::unordered_set<std::string> updated_tile_sheets;  // IMG updates waiting to be applied
+	std::unordered_map<std::string, SheetDependents> sheet_dependents; // Sheet key to the entities using it
+	std::vector<TileSheet> tile_sheets;    // Indexed by TileSheetHandle
+	std::unordered_map<std::string, TileSheetHandle> tile_sheet_handles;
+	bool in_batch;
+
+	// Time from MAI until every tile sheet the map asked for has a URL or was given up on
+	uint64_t map_started_at;
+	bool waiting_for_tile_sheets;
+	std::unordered_set<std::string> map_tile_sheets_waiting; // Asked for since the MAI, with no reply yet
+	uint8_t ticks_since_map;             // Up to 2; drawing asks for tile sheets, so a map has made its requests by the second tick
+	std::unordered_set<std::string> map_tile_sheets_abandoned; // Given up on, so asking again doesn't hold the timer up
+	unsigned int tile_sheets_requested;  // Different keys the map waited on
+	uint64_t tile_sheets_resolved_us;
 
 	bool map_received;
 	bool need_redraw;
@@ -241,30 +664,112 @@ public:
 
 	// Player state
 	std::string your_id;
+	EntityHandle your_handle;
 	float camera_x;
 	float camera_y;
 
 	bool walk_through_walls;
+	bool quiet_chat;          // Don't print chat, for headless sessions
+
+	// Movement prediction
+	std::deque<PredictedMove> predicted_moves;  // Steps the server hasn't confirmed yet, oldest first
+	uint32_t next_move_sequence;
+	int confirmed_x, confirmed_y;               // Last position the server agreed with
+	PredictionStats prediction_stats;
+
+	// Walking to a tile that was tapped on
+	PathFinder path_finder;
+	std::vector<uint8_t> walk_path;  // Directions to step in
+	size_t walk_path_position;       // Next step to take, walking if it's before the end
+	int walk_target_x, walk_target_y;
+	int walk_expect_x, walk_expect_y; // Where you should be before the next step
+	bool walk_path_stale;            // The map's walls changed, so plan again before the next step
+	uint64_t next_walk_step_at;
+
+	// Drawing other entities a little in the past, so their steps can be interpolated
+	InterpolationStats interpolation;
+
+	// Round trip measurement, only done when something asks for it
+	bool measure_round_trips;
+	uint64_t ping_sent_at;                      // Nonzero while our own PIN is waiting for a reply
+	std::vector<uint32_t> mov_round_trips_us;
+	std::vector<uint32_t> pin_round_trips_us;
+
+	// Inbound messages
+	InboundStats inbound_stats;
+	bool disable_fast_path;
+	FILE *capture_file;           // Every inbound frame gets written here, if set
+	uint64_t capture_started_at;
+	bool time_commands;           // Fill in command_timing, for replays
+	std::unordered_map<int, CommandTiming> command_timing;
+
+	// Outbound messages
+	PendingMove pending_move;
+	OutboundStats outbound_stats;
+	OutboundLaneQueue outbound_lanes[LANE_COUNT];
+	std::deque<OutboundFrame> frames_in_flight; // Frames queued in wslay, which reads them straight out of the lanes
+	size_t in_flight_bytes;
+	size_t outbound_byte_budget;  // Per network tick
+	size_t json_size_hint;        // Starting guess for how much room a message's JSON needs
+	bool server_supports_batch;   // Server acknowledged the "batch" feature in IDN
 
 	void websocket_write(std::string text);
+	void websocket_write(const char *text, size_t length);
 	void websocket_write(std::string command, cJSON *json);
+	char *begin_outbound_message(enum OutboundLane lane, size_t max_length);
+	void end_outbound_message(enum OutboundLane lane, size_t length);
+	void reset_outbound();
 	void websocket_message(const char *text, size_t length);
+	bool websocket_message_fast(const char *text, size_t length);
+	void apply_mov(const MovUpdate *mov);
+	void apply_who_add(const EntityUpdate *update);
+	void apply_who_update(const EntityUpdate *update);
+	void apply_who_list(cJSON *list);
+	bool start_capture(const char *filename);
+	void stop_capture();
+	void capture_message(const char *text, size_t length);
+	void print_command_timing();
 	int network_connect(std::string host, std::string path, std::string port);
 	void network_disconnect();
 	void network_update();
+	void queue_turn(int direction);
+	void queue_step(int from_x, int from_y, int to_x, int to_y, int direction);
+	void queue_bump(int bump_x, int bump_y, int direction);
+	void flush_pending_move();
+	void send_ping();
+	void flush_outbound();
+	void print_network_stats();
 
 	void request_image_asset(std::string key);
+	void flush_image_requests();
+	void finish_tile_sheet_wait();
+	void apply_tile_sheet_updates();
+	void track_tile_sheet(EntityHandle handle, Entity *entity);
 	void log_message(std::string text, std::string style);
 	void update_camera(float offset_x, float offset_y);
 	void draw_map(int camera_x, int camera_y);
+	void print_draw_stats();
 	Entity *your_entity();
 	void turn_player(int direction);
 	void move_player(int offset_x, int offset_y);
+	StepResult try_step(int from_x, int from_y, int offset_x, int offset_y, int direction);
+	void predict_step(const StepResult *step, int from_x, int from_y, int offset_x, int offset_y, int direction);
+	void mark_predictions_sent();
+	bool reconcile_position(int x, int y, bool echo);
+	void reset_prediction();
+	void remote_entity_moved(Entity *entity, int x, int y);
+	void rebuild_entity_grid();
+	void update_cell_collision(size_t index);
+	bool walk_to(int x, int y);
+	void update_walk();
+	void cancel_walk();
+	void rebuild_collision();
 
 	// Utility
 	bool is_turf_autotile_match(MapTileInfo *turf, int x, int y);
 	bool is_obj_autotile_match(MapTileInfo *obj, int x, int y);
-	unsigned int get_turf_autotile_index_4(MapTileInfo *turf, int x, int y);
-	unsigned int get_obj_autotile_index_4(MapTileInfo *obj, int x, int y);
+	TileSheetHandle get_tile_sheet(const std::string &key);
 	std::shared_ptr<MapTileInfo> get_shared_pointer_to_tile(MapTileInfo *tile);
+	std::shared_ptr<MapTileInfo> get_tile_by_key(const std::string &key);
+	void define_tile(const std::string &key, const MapTileInfo *tile);
 };